@@ -1,29 +1,110 @@
+#define _GNU_SOURCE
 #include "cache.h"
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /*
- * Initialize a new cache set with the given associativity and index of the first cache line.
+ * Magic number and version of the cache snapshot format.
+ */
+#define CACHE_FILE_MAGIC   "RDCACHE"
+#define CACHE_FILE_VERSION 8
+
+/*
+ * Number of accesses whose next uses cache_opt_replay keeps in memory at
+ * a time (8MB).
+ */
+#define CACHE_OPT_CHUNK (1 << 20)
+
+/*
+ * Number of accesses cache_replay looks ahead to prefetch the metadata
+ * of the set each will touch, and the size of line metadata from which
+ * it does: below it the metadata stays in the host's caches, and the
+ * prefetches cost more than they save.
+ */
+#define CACHE_REPLAY_PREFETCH_DISTANCE 16
+#define CACHE_REPLAY_PREFETCH_BYTES    (2 << 20)
+
+/*
+ * Number of accesses cache_replay_by_set partitions by set at a time.
+ */
+#define CACHE_BUCKET_CHUNK (1 << 20)
+
+/*
+ * Random number stream of the set being accessed, when sets have their
+ * own streams.
+ */
+static _Thread_local uint64_t *cache_random_state;
+
+/*
+ * Header of a cache snapshot. It is followed by the packed lines
+ * (cache_line_t, one uint32_t each), the lines whose tags escaped
+ * compression (a line index and a full tag, two uint64_t each), then,
+ * starting on a page
+ * boundary so they can be mapped in place, the recency lists, the
+ * sector bitmaps of a sectored cache and optionally the block data.
+ * Snapshots use the host's byte order and are meant to be loaded on the
+ * machine that wrote them.
+ */
+typedef struct cache_file_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+
+    /* Geometry and policies. */
+    uint64_t line_size, sector_size, associativity, num_lines;
+    uint64_t policies;
+
+    /* Statistics. */
+    uint64_t access_count, miss_count, sector_miss_count;
+    uint64_t bytes_fetched, bytes_written;
+
+    /* Timing model and its state. */
+    cache_timing_t timing;
+    uint64_t busy_cycles, miss_latency_cycles;
+    uint64_t now, bus_free_at, outstanding_until;
+    uint64_t coalesced_count, mshr_stall_count;
+    uint64_t mshr_stall_cycles, mshr_occupancy_cycles, outstanding_cycles;
+
+    /* Set dueling policy selectors, and the BIP throttle. */
+    uint64_t psel, dip_psel, bip_throttle;
+
+    /* Tag compression windows, and the number of escaped tags following
+     * the lines. */
+    uint64_t tag_regions[CACHE_TAG_WINDOWS];
+    uint64_t tag_windows, escaped;
+
+    /* Offset of the mappable part of the file. */
+    uint64_t mapping_offset;
+} cache_file_header_t;
+
+/*
+ * Initialize a new cache set with the given associativity, index of the
+ * first cache line and recency list.
  */
 static void cache_set_init(cache_set_t *cache_set, unsigned int associativity,
-                           cache_line_t *lines, int first_index) {
+                           cache_line_t *lines, int first_index, int *mru_list) {
     cache_set->size = associativity;
     cache_set->lines = lines;
     cache_set->first_index = first_index;
-    cache_set->mru_list = malloc(associativity * sizeof(int));
+    cache_set->mru_list = mru_list;
 
     for (int i = 0; i < associativity; i++) {
-        cache_set->lines[first_index + i].is_valid = 0;
+        cache_set->lines[first_index + i].bits = 0;
         cache_set->mru_list[i] = i;
     }
 }
 
 /*
  * Given a value n which is a power of 2 (for example, a block size or a
- * number of sets in a cache), calculate log_2 of n.
+ * number of sets in a cache), calculate log_2 of n. For any other value
+ * this is floor(log_2 n).
  */
-static unsigned int logbase2(int value) {
+static unsigned int logbase2(uint64_t value) {
     unsigned int ans = 0;
     while (value > 1) {
         ans++;
@@ -33,10 +114,170 @@ static unsigned int logbase2(int value) {
 }
 
 /*
- * Given a number of bits, return a mask that many bits wide.
+ * Precompute the magic multiplier for dividing 64-bit values by the
+ * given (non-zero) divisor. This is the round-up method: for a divisor
+ * d with floor(log_2 d) = k, the magic is floor(2^(64+k) / d) + 1, and
+ * when that does not fit in 64 bits we keep the low bits and fix the
+ * quotient up with an add-and-halve step.
+ */
+static void cache_divisor_init(cache_divisor_t *divisor, uint64_t value) {
+    unsigned int floor_log = logbase2(value);
+
+    divisor->divisor = value;
+    divisor->shift = floor_log;
+    divisor->add = 0;
+    divisor->magic = 0;
+
+    if ((value & (value - 1)) == 0) {
+        return;
+    }
+
+    unsigned __int128 numerator = (unsigned __int128)1 << (64 + floor_log);
+    uint64_t proposed = (uint64_t)(numerator / value);
+    uint64_t rem = (uint64_t)(numerator % value);
+
+    if (value - rem >= ((uint64_t)1 << floor_log)) {
+        uint64_t twice_rem = rem + rem;
+        proposed += proposed;
+        if (twice_rem >= value || twice_rem < rem) {
+            proposed++;
+        }
+        divisor->add = 1;
+    }
+    divisor->magic = proposed + 1;
+}
+
+/*
+ * Divide a 64-bit value using a precomputed divisor.
+ */
+static inline uint64_t cache_divide(const cache_divisor_t *divisor, uint64_t value) {
+    if (divisor->magic == 0) {
+        return value >> divisor->shift;
+    }
+
+    uint64_t q = (uint64_t)(((unsigned __int128)value * divisor->magic) >> 64);
+    if (divisor->add) {
+        q += (value - q) >> 1;
+    }
+    return q >> divisor->shift;
+}
+
+/*
+ * Split an address, whose block number is already known, into its block
+ * offset, set index and tag. The set index is the block number modulo
+ * the number of sets, computed from the quotient rather than with a
+ * hardware remainder.
+ */
+static inline void cache_decode(cache_t *cache, uintptr_t address, uint64_t block,
+                                size_t *offset, unsigned int *index, uintptr_t *tag) {
+    uint64_t quotient = cache_divide(&cache->set_divisor, block);
+
+    *offset = address - block * cache->line_size;
+    *index = block - quotient * cache->num_sets;
+    *tag = quotient;
+}
+
+/*
+ * Return the compressed form of a tag: its window and offset, or
+ * CACHE_TAG_ESCAPE if its region has no window and none is left. A tag
+ * in a new region gets a window if allocate is set; otherwise, while
+ * windows are left, no line can hold it and CACHE_TAG_ABSENT is
+ * returned.
+ */
+#define CACHE_TAG_ABSENT UINT32_MAX
+
+static inline uint32_t cache_tag_code(cache_t *cache, uintptr_t tag, int allocate) {
+    uint64_t region = (uint64_t)tag >> CACHE_TAG_OFFSET_BITS;
+    uint32_t offset = tag & CACHE_TAG_OFFSET_MASK;
+
+    for (unsigned int w = 0; w < cache->tag_windows; w++) {
+        if (cache->tag_regions[w] == region) {
+            return w << CACHE_TAG_OFFSET_BITS | offset;
+        }
+    }
+    if (cache->tag_windows == CACHE_TAG_WINDOWS) {
+        return CACHE_TAG_ESCAPE;
+    }
+    if (!allocate) {
+        return CACHE_TAG_ABSENT;
+    }
+    cache->tag_regions[cache->tag_windows] = region;
+    return cache->tag_windows++ << CACHE_TAG_OFFSET_BITS | offset;
+}
+
+/*
+ * Return the entry of the table of escaped tags for a line, or the empty
+ * entry where it would go. Entries are probed linearly from the line
+ * index modulo the capacity, so the lines of a set probe neighbouring
+ * entries.
+ */
+static cache_escaped_tag_t *cache_escaped_tag_find(cache_t *cache, size_t line_index) {
+    size_t mask = cache->escaped_capacity - 1;
+    size_t slot = line_index & mask;
+
+    while (cache->escaped_tags[slot].line != 0 && cache->escaped_tags[slot].line != line_index + 1) {
+        slot = (slot + 1) & mask;
+    }
+    return &cache->escaped_tags[slot];
+}
+
+/*
+ * Record the full tag of a line holding an escaped tag, growing the
+ * table to keep it at most half full.
+ */
+static void cache_escaped_tag_set(cache_t *cache, size_t line_index, uint64_t tag) {
+    if ((cache->escaped_count + 1) * 2 > cache->escaped_capacity) {
+        cache_escaped_tag_t *old = cache->escaped_tags;
+        size_t old_capacity = cache->escaped_capacity;
+        cache->escaped_capacity = old_capacity != 0 ? old_capacity * 2 : 16;
+        cache->escaped_tags = (cache_escaped_tag_t *)calloc(cache->escaped_capacity, sizeof(cache_escaped_tag_t));
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i].line != 0) {
+                *cache_escaped_tag_find(cache, old[i].line - 1) = old[i];
+            }
+        }
+        free(old);
+    }
+
+    cache_escaped_tag_t *entry = cache_escaped_tag_find(cache, line_index);
+    if (entry->line == 0) {
+        entry->line = line_index + 1;
+        cache->escaped_count++;
+    }
+    entry->tag = tag;
+}
+
+/*
+ * Forget the full tag of a line that no longer holds an escaped tag.
+ * Later entries of the probe sequence are shifted back into the hole, so
+ * lookups never need tombstones.
+ */
+static void cache_escaped_tag_remove(cache_t *cache, size_t line_index) {
+    cache_escaped_tag_t *tags = cache->escaped_tags;
+    size_t mask = cache->escaped_capacity - 1;
+    size_t hole = cache_escaped_tag_find(cache, line_index) - tags;
+
+    if (tags[hole].line == 0) {
+        return;
+    }
+    cache->escaped_count--;
+    for (size_t slot = (hole + 1) & mask; tags[slot].line != 0; slot = (slot + 1) & mask) {
+        size_t home = (tags[slot].line - 1) & mask;
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            tags[hole] = tags[slot];
+            hole = slot;
+        }
+    }
+    tags[hole].line = 0;
+}
+
+/*
+ * Determine whether a line holds a tag, given its compressed form,
+ * whatever the line's state.
  */
-static unsigned long maskbits(int nbits) {
-    return (1L << nbits) - 1;
+static inline int cache_line_holds(cache_t *cache, cache_line_t *line, uint32_t code, uintptr_t tag) {
+    return (line->bits & CACHE_LINE_TAG_MASK) == code
+           && (code != CACHE_TAG_ESCAPE || cache_escaped_tag_find(cache, line - cache->lines)->tag == tag);
 }
 
 /*
@@ -46,11 +287,45 @@ static unsigned long maskbits(int nbits) {
  */
 cache_t *cache_new(size_t num_bytes, size_t block_size,
                    unsigned int associativity, int policies) {
+    return cache_new_sectored(num_bytes, block_size, block_size, associativity, policies);
+}
+
+/*
+ * Create a new cache whose lines are filled and written back sector_size
+ * bytes at a time.
+ */
+cache_t *cache_new_sectored(size_t num_bytes, size_t block_size, size_t sector_size,
+                            unsigned int associativity, int policies) {
+
+    // Reject geometries that cannot be laid out as whole lines and sets,
+    // or whose line count does not fit the int indices of the sets.
+    if (block_size < sizeof(uint32_t) || associativity == 0 || num_bytes == 0
+        || num_bytes % block_size != 0 || (num_bytes / block_size) % associativity != 0
+        || num_bytes / block_size > INT_MAX
+        || sector_size < sizeof(uint32_t) || block_size % sector_size != 0) {
+        return NULL;
+    }
 
     // Create the cache and initialize constant fields.
     cache_t *cache = (cache_t *)malloc(sizeof(cache_t));
     cache->access_count = 0;
     cache->miss_count = 0;
+    cache->sector_miss_count = 0;
+    cache->bytes_fetched = 0;
+    cache->bytes_written = 0;
+    cache->busy_cycles = 0;
+    cache->miss_latency_cycles = 0;
+    memset(&cache->timing, 0, sizeof(cache->timing));
+    cache->now = 0;
+    cache->bus_free_at = 0;
+    cache->outstanding_until = 0;
+    cache->mshrs = NULL;
+    cache->mshr_count = 0;
+    cache->coalesced_count = 0;
+    cache->mshr_stall_count = 0;
+    cache->mshr_stall_cycles = 0;
+    cache->mshr_occupancy_cycles = 0;
+    cache->outstanding_cycles = 0;
     cache->policies = policies;
 
     // Initialize size fields.
@@ -59,44 +334,100 @@ cache_t *cache_new(size_t num_bytes, size_t block_size,
     cache->associativity = associativity;
     cache->num_sets = cache->num_lines / associativity;
 
-    // Initialize shifts and masks in cache structure
-    uint64_t offset_mask, index_mask;
-    unsigned int offset_bits, index_bits;
+    // Initialize the divisors used to decode addresses. An address
+    // divided by the line size gives the block number; the block number
+    // divided by the number of sets gives the tag, and the remainder
+    // gives the set index.
+    cache_divisor_init(&cache->line_divisor, block_size);
+    cache_divisor_init(&cache->set_divisor, cache->num_sets);
 
-    offset_bits = logbase2(block_size);
-    offset_mask = maskbits(offset_bits);
-    index_bits = logbase2(cache->num_sets);
-    index_mask = maskbits(index_bits);
-
-    // We shift by the number of bits in the offset to get
-    // to the index bits.
-    cache->block_offset_mask = offset_mask;
-    cache->cache_index_shift = offset_bits;
-    cache->cache_index_mask = index_mask << offset_bits;
+    // Initialize set dueling: leaders are spread evenly, with at least
+    // as many followers as leaders, and followers start out on LRU
+    // replacement and MRU insertion. DIP leaders sit between those of
+    // adaptive replacement.
+    if (cache->num_sets < 4) {
+        cache->duel_spacing = 0;
+    } else if (cache->num_sets / CACHE_DUEL_LEADERS < 4) {
+        cache->duel_spacing = 4;
+    } else {
+        cache->duel_spacing = cache->num_sets / CACHE_DUEL_LEADERS;
+    }
+    cache->psel = CACHE_PSEL_MAX / 2;
+    cache->dip_psel = CACHE_PSEL_MAX / 2;
+    cache->bip_throttle = CACHE_BIP_THROTTLE;
+    cache->next_use = NULL;
 
-    // We shift by the number of offset bits and index bits
-    // to get the tag bits.
-    cache->tag_shift = offset_bits + index_bits;
-    cache->tag_mask = maskbits(64 - cache->tag_shift) << cache->tag_shift;
+    // Initialize sector fields. Each line of a sectored cache gets a
+    // valid bitmap followed by a dirty bitmap, sector_words 64-bit words
+    // each; a line of a single sector keeps both bits in its word.
+    cache->sector_size = sector_size;
+    cache->sectors_per_line = block_size / sector_size;
+    cache->sector_words = (cache->sectors_per_line + 63) / 64;
+    cache_divisor_init(&cache->sector_divisor, sector_size);
+    cache->sector_bits = cache->sectors_per_line == 1 ? NULL
+                         : calloc((size_t)cache->num_lines * cache->sector_words * 2, sizeof(uint64_t));
 
-    // Allocate the cache memory
-    cache->memory = malloc(num_bytes);
-    uint8_t *memory = cache->memory;
+    // Allocate the cache memory, unless the cache only keeps tags.
+    if ((policies & CACHE_DATAPOLICY_MASK) == CACHE_DATAPOLICY_NODATA) {
+        cache->memory = NULL;
+    } else {
+        cache->memory = malloc(num_bytes);
+    }
 
-    // Initialize cache lines.
+    // Initialize cache lines. They start out invalid; their blocks and
+    // sector bits are found from their index.
     cache->lines = (cache_line_t *)calloc(cache->num_lines, sizeof(cache_line_t));
-    for (int i = 0; i < cache->num_lines; i++) {
-        cache->lines[i].block = memory;
-	memory += cache->line_size;
-    }
-    
-    // Initialize cache sets.
+
+    // Initialize cache sets. Their recency lists share one array.
     cache->sets = (cache_set_t *)calloc(cache->num_sets, sizeof(cache_set_t));
+    cache->mru_lists = malloc(cache->num_lines * sizeof(int));
     int first_index = 0;
-    for (int i = 0; i < cache->num_sets; i++) {
-        cache_set_init(&cache->sets[i], associativity, cache->lines, first_index);
+    for (unsigned int i = 0; i < cache->num_sets; i++) {
+        cache_set_init(&cache->sets[i], associativity, cache->lines, first_index,
+                       cache->mru_lists + first_index);
 	first_index += associativity;
     }
+    cache->mapping = NULL;
+    cache->mapping_size = 0;
+    cache->fork_fd = -1;
+    cache->fork_offset = 0;
+    cache->fork_changes = 0;
+    cache->changes = 0;
+
+    // Initialize bypass prediction, with every signature starting out
+    // halfway to bypassing.
+    cache->bypass_count = 0;
+    cache->bypass_reuse_count = 0;
+    cache->dead_eviction_count = 0;
+    if ((policies & CACHE_BYPASS_MASK) == CACHE_BYPASSPOLICY) {
+        cache->bypass_counters = malloc((size_t)1 << CACHE_BYPASS_SIGNATURE_BITS);
+        memset(cache->bypass_counters, (CACHE_BYPASS_COUNTER_MAX + 1) / 2, (size_t)1 << CACHE_BYPASS_SIGNATURE_BITS);
+        cache->line_signatures = calloc(cache->num_lines, sizeof(uint16_t));
+        cache->line_reused = calloc(cache->num_lines, sizeof(uint8_t));
+        cache->bypass_ghost = cache_new(num_bytes, block_size, associativity,
+                                        CACHE_REPLACEMENTPOLICY_LRU | CACHE_DATAPOLICY_NODATA);
+    } else {
+        cache->bypass_counters = NULL;
+        cache->line_signatures = NULL;
+        cache->line_reused = NULL;
+        cache->bypass_ghost = NULL;
+    }
+
+    // Way partitioning is set up by cache_set_class_ways.
+    cache->class_masks = NULL;
+    cache->class_stats = NULL;
+    cache->line_classes = NULL;
+    cache->access_class = 0;
+
+    cache->observer = NULL;
+    cache->observer_context = NULL;
+    cache->set_random = NULL;
+
+    memset(cache->tag_regions, 0, sizeof(cache->tag_regions));
+    cache->tag_windows = 0;
+    cache->escaped_tags = NULL;
+    cache->escaped_capacity = 0;
+    cache->escaped_count = 0;
 
     return cache;
 }
@@ -105,14 +436,34 @@ cache_t *cache_new(size_t num_bytes, size_t block_size,
  * Frees all memory allocated for a cache.
  */
 void cache_free(cache_t *cache) {
-    /* TO BE COMPLETED BY THE STUDENT */
-    for(int i = 0; i < (cache->num_sets); i++){
-        free(cache->sets[i].mru_list);      // free the cache mru list for each set (initiated in cache_init)
+    // The recency lists, sector bitmaps and block data of a loaded
+    // snapshot live in a single mapping of the file.
+    if (cache->mapping != NULL) {
+        munmap(cache->mapping, cache->mapping_size);
+    } else {
+        free(cache->mru_lists);
+        free(cache->sector_bits);
+        free(cache->memory);
     }
-    
+    if (cache->fork_fd >= 0) {
+        close(cache->fork_fd);
+    }
+
+    if (cache->bypass_ghost != NULL) {
+        cache_free(cache->bypass_ghost);
+    }
+    free(cache->bypass_counters);
+    free(cache->line_signatures);
+    free(cache->line_reused);
+    free(cache->class_masks);
+    free(cache->class_stats);
+    free(cache->line_classes);
+    free(cache->set_random);
+    free(cache->escaped_tags);
+
     free(cache->sets);
     free(cache->lines);
-    free(cache->memory);
+    free(cache->mshrs);
     free(cache);
 
 }
@@ -120,25 +471,75 @@ void cache_free(cache_t *cache) {
 /*
  * Determine whether or not a cache line is valid for a given tag.
  */
-int cache_line_check_validity_and_tag(cache_line_t *cache_line, uintptr_t tag) {
-    /* TO BE COMPLETED BY THE STUDENT */
-    if(cache_line->is_valid){
-        if(cache_line->tag == tag){
-            return 1;
-        }
+int cache_line_check_validity_and_tag(cache_t *cache, cache_line_t *cache_line, uintptr_t tag) {
+    uint32_t code = cache_tag_code(cache, tag, 0);
+    return code != CACHE_TAG_ABSENT && cache_line_state(cache_line) != CACHE_LINE_INVALID
+           && cache_line_holds(cache, cache_line, code, tag);
+}
+
+/*
+ * Return long integer data from a cache line.
+ */
+long cache_line_retrieve_data(cache_t *cache, cache_line_t *cache_line, size_t offset) {
+    uint8_t *block = cache_line_block(cache, cache_line);
+    if (block == NULL) {
+        return 0;       // tag-only cache
+    }
+    return *(uint32_t *)&block[offset];
+}
+
+/*
+ * Return the full tag of a line.
+ */
+uintptr_t cache_line_tag(cache_t *cache, cache_line_t *line) {
+    uint32_t code = line->bits & CACHE_LINE_TAG_MASK;
+    if (code == CACHE_TAG_ESCAPE) {
+        return cache_escaped_tag_find(cache, line - cache->lines)->tag;
     }
+    return (uintptr_t)cache->tag_regions[code >> CACHE_TAG_OFFSET_BITS] << CACHE_TAG_OFFSET_BITS
+           | (code & CACHE_TAG_OFFSET_MASK);
+}
 
-    return 0;
+/*
+ * Return the block data of a line.
+ */
+uint8_t *cache_line_block(cache_t *cache, cache_line_t *line) {
+    if (cache->memory == NULL) {
+        return NULL;
+    }
+    return cache->memory + (size_t)(line - cache->lines) * cache->line_size;
 }
 
 /*
- * Return long integer data from a cache line.
+ * Return the sector bits of a line.
  */
-long cache_line_retrieve_data(cache_line_t *cache_line, size_t offset) {
-    /* TO BE COMPLETED BY THE STUDENT */
-    uint32_t* longptr;
-    longptr = (uint32_t *) (&cache_line->block[offset]);
-    return *longptr;
+uint64_t *cache_line_sectors(cache_t *cache, cache_line_t *line) {
+    if (cache->sector_bits == NULL) {
+        return NULL;
+    }
+    return cache->sector_bits + (size_t)(line - cache->lines) * 2 * cache->sector_words;
+}
+
+/*
+ * Return word w of a line's valid bits, or of its dirty bits if dirty is
+ * set, or store it. Lines of a single sector keep the bit in their word.
+ */
+static inline uint64_t cache_line_sector_word(cache_t *cache, cache_line_t *line, int dirty,
+                                              unsigned int w) {
+    if (cache->sector_bits == NULL) {
+        return (line->bits & (dirty ? CACHE_LINE_SECTOR_DIRTY : CACHE_LINE_SECTOR_VALID)) != 0;
+    }
+    return cache_line_sectors(cache, line)[dirty * cache->sector_words + w];
+}
+
+static inline void cache_line_set_sector_word(cache_t *cache, cache_line_t *line, int dirty,
+                                              unsigned int w, uint64_t value) {
+    if (cache->sector_bits == NULL) {
+        uint32_t bit = dirty ? CACHE_LINE_SECTOR_DIRTY : CACHE_LINE_SECTOR_VALID;
+        line->bits = value & 1 ? line->bits | bit : line->bits & ~bit;
+        return;
+    }
+    cache_line_sectors(cache, line)[dirty * cache->sector_words + w] = value;
 }
 
 /*
@@ -149,9 +550,9 @@ long cache_line_retrieve_data(cache_line_t *cache_line, size_t offset) {
  * lines whose valid bit is 0 will occur after all cache lines whose
  * valid bit is 1.
  */
-static void cache_line_make_mru(cache_t *cache, cache_set_t *cache_set, size_t line_index) {
+static void cache_line_make_mru(cache_t *cache, cache_set_t *cache_set, int line_index) {
     int index_of_line_index = -1;
-    for (int i = 0; i < cache->associativity; i++) {
+    for (int i = 0; i < (int)cache->associativity; i++) {
         if (cache_set->mru_list[i] == line_index) {
             index_of_line_index = i;
             break;
@@ -164,20 +565,47 @@ static void cache_line_make_mru(cache_t *cache, cache_set_t *cache_set, size_t l
     cache_set->mru_list[0] = line_index;
 }
 
+/*
+ * Move the cache line with the given index to the end of the recency
+ * list of its set, so it is tagged as the least recently used one.
+ */
+static void cache_line_make_lru(cache_t *cache, cache_set_t *cache_set, int line_index) {
+    int last = (int)cache->associativity - 1;
+    int index_of_line_index = last;
+    for (int i = 0; i < last; i++) {
+        if (cache_set->mru_list[i] == line_index) {
+            index_of_line_index = i;
+            break;
+        }
+    }
+
+    for (int i = index_of_line_index; i < last; i++) {
+        cache_set->mru_list[i] = cache_set->mru_list[i + 1];
+    }
+    cache_set->mru_list[last] = line_index;
+}
+
 /*
  * Retrieve a matching cache line from a set, if one exists.
  */
 cache_line_t *cache_set_find_matching_line(cache_t *cache, cache_set_t *cache_set,
                                            uintptr_t tag) {
     /* TO BE COMPLETED BY THE STUDENT */
+    // Compress the tag once for the whole set. Valid lines have a
+    // nonzero state in the top bits.
+    uint32_t code = cache_tag_code(cache, tag, 0);
+    if (code == CACHE_TAG_ABSENT) {
+        return NULL;
+    }
     for(int i = 0; i < cache_set->size; i++){
         cache_line_t *currline = &(cache_set->lines[cache_set->first_index + i]);
 
-        if(cache_line_check_validity_and_tag(currline, tag)){
+        if(currline->bits >= (uint32_t)1 << CACHE_LINE_STATE_SHIFT && cache_line_holds(cache, currline, code, tag)){
             
-            if((cache->policies == CACHE_REPLACEMENTPOLICY_LRU) || (cache->policies == CACHE_REPLACEMENTPOLICY_MRU)){
+            if((cache->policies & CACHE_REPLACEMENTPOLICY_MASK) != CACHE_REPLACEMENTPOLICY_RANDOM){
                 //update repacement policy
                 cache_line_make_mru(cache, cache_set, i);
+                cache->changes++;
             }
             return currline;
         }
@@ -186,6 +614,110 @@ cache_line_t *cache_set_find_matching_line(cache_t *cache, cache_set_t *cache_se
     return NULL; // Added to remove warning; remove once function is implemented.
 }
 
+/*
+ * Return the replacement policy a set uses on a miss. Under the adaptive
+ * policy, leader sets use a fixed policy and follower sets use the
+ * policy PSEL currently favours.
+ */
+static int cache_set_replacement_policy(cache_t *cache, cache_set_t *cache_set) {
+    int policy = cache->policies & CACHE_REPLACEMENTPOLICY_MASK;
+    if (policy != CACHE_REPLACEMENTPOLICY_ADAPTIVE) {
+        return policy;
+    }
+    if (cache->duel_spacing == 0) {
+        return CACHE_REPLACEMENTPOLICY_LRU;
+    }
+
+    unsigned int leader = (cache_set - cache->sets) % cache->duel_spacing;
+    if (leader == 0) {
+        return CACHE_REPLACEMENTPOLICY_LRU;
+    }
+    if (leader == cache->duel_spacing / 2) {
+        return CACHE_REPLACEMENTPOLICY_MRU;
+    }
+    return cache_duel_winner(cache);
+}
+
+/*
+ * Record a miss in a set in the selector of any duel the set leads.
+ * Misses in the adaptive policy's LRU leaders and DIP's MRU leaders
+ * count up, and misses in the MRU and BIP leaders count down.
+ */
+static void cache_set_record_miss(cache_t *cache, cache_set_t *cache_set) {
+    if (cache->duel_spacing == 0) {
+        return;
+    }
+
+    unsigned int leader = (cache_set - cache->sets) % cache->duel_spacing;
+    if ((cache->policies & CACHE_REPLACEMENTPOLICY_MASK) == CACHE_REPLACEMENTPOLICY_ADAPTIVE) {
+        if (leader == 0 && cache->psel < CACHE_PSEL_MAX) {
+            cache->psel++;
+        } else if (leader == cache->duel_spacing / 2 && cache->psel > 0) {
+            cache->psel--;
+        }
+    }
+    if ((cache->policies & CACHE_INSERTIONPOLICY_MASK) == CACHE_INSERTIONPOLICY_DIP) {
+        if (leader == cache->duel_spacing / 4 && cache->dip_psel < CACHE_PSEL_MAX) {
+            cache->dip_psel++;
+        } else if (leader == cache->duel_spacing * 3 / 4 && cache->dip_psel > 0) {
+            cache->dip_psel--;
+        }
+    }
+}
+
+/*
+ * Return the insertion policy a set uses for a fill. Under DIP, leader
+ * sets use a fixed policy and follower sets use the policy DIP's PSEL
+ * currently favours.
+ */
+static int cache_set_insertion_policy(cache_t *cache, cache_set_t *cache_set) {
+    int policy = cache->policies & CACHE_INSERTIONPOLICY_MASK;
+    if (policy != CACHE_INSERTIONPOLICY_DIP) {
+        return policy;
+    }
+    if (cache->duel_spacing == 0) {
+        return CACHE_INSERTIONPOLICY_MRU;
+    }
+
+    unsigned int leader = (cache_set - cache->sets) % cache->duel_spacing;
+    if (leader == cache->duel_spacing / 4) {
+        return CACHE_INSERTIONPOLICY_MRU;
+    }
+    if (leader == cache->duel_spacing * 3 / 4) {
+        return CACHE_INSERTIONPOLICY_BIP;
+    }
+    return cache_dip_winner(cache);
+}
+
+/*
+ * Place a newly filled line in the recency list of its set according to
+ * the insertion policy.
+ */
+static void cache_set_insert(cache_t *cache, cache_set_t *cache_set, size_t line_index,
+                             func_t generate_random_number) {
+    int policy = cache_set_insertion_policy(cache, cache_set);
+
+    if (policy == CACHE_INSERTIONPOLICY_LIP
+        || (policy == CACHE_INSERTIONPOLICY_BIP && generate_random_number() % cache->bip_throttle != 0)) {
+        cache_line_make_lru(cache, cache_set, line_index);
+    } else {
+        cache_line_make_mru(cache, cache_set, line_index);
+    }
+}
+
+/*
+ * Return the mask of the ways the class being served may fill, and
+ * whether a way is in a mask. Without way partitioning every way is
+ * allowed, however many there are.
+ */
+static uint64_t cache_class_ways(cache_t *cache) {
+    return cache->class_masks != NULL ? cache->class_masks[cache->access_class] : ~(uint64_t)0;
+}
+
+static int cache_way_allowed(uint64_t ways, int way) {
+    return way >= 64 || ((ways >> way) & 1);
+}
+
 /*
  * Function to find a cache line to use for new data. Uses either a
  * line not being used, or a suitable line to be replaced, based on
@@ -198,25 +730,65 @@ cache_line_t *find_available_cache_line(cache_t *cache, cache_set_t *cache_set,
      * cache line to use.  To generate a random number in the range [0, n),
      * use "generate_random_number() % n".
      */
+    // Under way partitioning only the ways of the class being served
+    // may be filled or evicted. Either way the recency list changes.
+    uint64_t ways = cache_class_ways(cache);
+    cache->changes++;
+
     for(int i = 0; i < cache_set->size; i++){       //there is an unused cache line
-        if(!(cache_set->lines[cache_set->first_index + i].is_valid)){
-            if((cache->policies == CACHE_REPLACEMENTPOLICY_MRU) || cache->policies == CACHE_REPLACEMENTPOLICY_LRU){
-                cache_line_make_mru(cache, cache_set, i);
+        if(cache_line_state(&cache_set->lines[cache_set->first_index + i]) == CACHE_LINE_INVALID && cache_way_allowed(ways, i)){
+            if((cache->policies & CACHE_REPLACEMENTPOLICY_MASK) != CACHE_REPLACEMENTPOLICY_RANDOM){
+                cache_set_insert(cache, cache_set, i, generate_random_number);
             }
             return &cache_set->lines[cache_set->first_index + i];
         }
     }
-    
-    if(cache->policies == CACHE_REPLACEMENTPOLICY_MRU){
-        cache_line_make_mru(cache, cache_set, cache_set->mru_list[0]);
-        return &cache_set->lines[cache_set->first_index + cache_set->mru_list[0]];
-    }else if(cache->policies == CACHE_REPLACEMENTPOLICY_LRU){
-        int lru_index = cache_set->mru_list[(cache_set->size) - 1];
 
-        cache_line_make_mru(cache, cache_set, lru_index);
+    if(cache->next_use != NULL){
+        // Belady's OPT: evict the line used again furthest in the future.
+        uint64_t *next_use = cache->next_use + cache_set->first_index;
+        int opt_index = -1;
+        for(int i = 0; i < cache_set->size; i++){
+            if(cache_way_allowed(ways, i) && (opt_index < 0 || next_use[i] > next_use[opt_index])){
+                opt_index = i;
+            }
+        }
+        if((cache->policies & CACHE_REPLACEMENTPOLICY_MASK) != CACHE_REPLACEMENTPOLICY_RANDOM){
+            cache_line_make_mru(cache, cache_set, opt_index);
+        }
+        return &cache_set->lines[cache_set->first_index + opt_index];
+    }
+
+    int policy = cache_set_replacement_policy(cache, cache_set);
+    if(policy == CACHE_REPLACEMENTPOLICY_MRU){
+        int k = 0;
+        while(!cache_way_allowed(ways, cache_set->mru_list[k])){
+            k++;
+        }
+        int mru_index = cache_set->mru_list[k];
+
+        cache_set_insert(cache, cache_set, mru_index, generate_random_number);
+        return &cache_set->lines[cache_set->first_index + mru_index];
+    }else if(policy == CACHE_REPLACEMENTPOLICY_LRU){
+        int k = cache_set->size - 1;
+        while(!cache_way_allowed(ways, cache_set->mru_list[k])){
+            k--;
+        }
+        int lru_index = cache_set->mru_list[k];
+
+        cache_set_insert(cache, cache_set, lru_index, generate_random_number);
         //printf("last recently used: %d\n", lru_index);
         return &cache_set->lines[cache_set->first_index + lru_index];
     }
+    if(cache->class_masks != NULL){
+        // Pick the n'th allowed way.
+        int n = generate_random_number() % __builtin_popcountll(ways);
+        int way = 0;
+        while(!cache_way_allowed(ways, way) || n-- > 0){
+            way++;
+        }
+        return &cache_set->lines[cache_set->first_index + way];
+    }
     int random_line = generate_random_number() % cache_set->size;
     return &cache_set->lines[cache_set->first_index + random_line];
 
@@ -237,73 +809,1423 @@ cache_line_t *find_available_cache_line(cache_t *cache, cache_set_t *cache_set,
 }
 
 /*
- * Add a block to a given cache set.
+ * Return the number of MSHRs of a non-blocking cache.
  */
-static cache_line_t *cache_set_add(cache_t *cache, cache_set_t *cache_set,
-                                   uintptr_t address, uintptr_t tag, func_t generate_random_number) {
-    /* TO BE COMPLETED BY THE STUDENT */
-    // First locate the cache line to use.
-    cache_line_t *line = find_available_cache_line(cache, cache_set, generate_random_number);
+static unsigned int cache_mshr_limit(cache_t *cache) {
+    return cache->timing.mshrs > 0 ? cache->timing.mshrs : 1;
+}
 
-    // Now set it up.
-    line->tag = tag;
-    line->is_valid = 1;
-    memcpy(line->block, (void *)(address & ~cache->block_offset_mask), cache->line_size);
+/*
+ * Return the number of cycles the memory bus needs to move the given
+ * number of bytes.
+ */
+static uint64_t cache_transfer_cycles(cache_t *cache, size_t bytes) {
+    if (cache->timing.fill_bandwidth == 0) {
+        return 0;
+    }
+    return (bytes + cache->timing.fill_bandwidth - 1) / cache->timing.fill_bandwidth;
+}
 
-    // And return it.
-    return line;
+/*
+ * Free the MSHRs whose fills have completed by the current cycle.
+ */
+static void cache_mshr_retire(cache_t *cache) {
+    unsigned int i = 0;
+    while (i < cache->mshr_count) {
+        if (cache->mshrs[i].ready <= cache->now) {
+            cache->mshrs[i] = cache->mshrs[--cache->mshr_count];
+        } else {
+            i++;
+        }
+    }
 }
 
 /*
- * Read a single long integer from the cache.
+ * Return whether a fill of the given sector address is in flight.
  */
-long cache_read(cache_t *cache, uintptr_t address, func_t generate_random_number) {
-    /* TO BE COMPLETED BY THE STUDENT */
-    // get offset, index and tag for cache line
-    unsigned int offset = address & cache->block_offset_mask;
-    unsigned int index = (address & cache->cache_index_mask) >> cache->cache_index_shift;
-    uintptr_t tag = (address & cache->tag_mask) >> cache->tag_shift;
-    
-    cache_set_t *cache_set = &cache->sets[index];
-    cache_line_t *resulting_line = cache_set_find_matching_line(cache, cache_set, tag);
-    cache->access_count++;
+static int cache_mshr_find(cache_t *cache, uintptr_t address) {
+    for (unsigned int i = 0; i < cache->mshr_count; i++) {
+        if (cache->mshrs[i].address == address) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    // cache line is not in cache
-    if(resulting_line == NULL){
-        cache->miss_count++;
-        if ((cache->policies & CACHE_TRACE_MASK) == CACHE_TRACEPOLICY) {
-            fprintf(stderr, "Cache hit in set %3u for address 0x%" PRIxPTR "\n", index, address);
+/*
+ * Start a fill of the given sector address in a non-blocking cache,
+ * stalling first if every MSHR is busy. The data arrives after the miss
+ * penalty, once the bus is free and the transfer has completed.
+ */
+static void cache_mshr_issue(cache_t *cache, uintptr_t address) {
+    if (cache->mshr_count == cache_mshr_limit(cache)) {
+        uint64_t earliest = cache->mshrs[0].ready;
+        for (unsigned int i = 1; i < cache->mshr_count; i++) {
+            if (cache->mshrs[i].ready < earliest) {
+                earliest = cache->mshrs[i].ready;
+            }
         }
-        return cache_line_retrieve_data(cache_set_add(cache, cache_set, address, tag, generate_random_number), offset);
+        cache->mshr_stall_count++;
+        cache->mshr_stall_cycles += earliest - cache->now;
+        cache->now = earliest;
+        cache_mshr_retire(cache);
     }
-    //cache line is in cache
-    else{ 
-        if ((cache->policies & CACHE_TRACE_MASK) == CACHE_TRACEPOLICY) {
-        fprintf(stderr, "Cache  hit in set %3u for address 0x%" PRIxPTR "\n", index, address);
+
+    uint64_t ready = cache->now + cache->timing.miss_penalty;
+    uint64_t transfer = cache_transfer_cycles(cache, cache->sector_size);
+    if (transfer != 0) {
+        if (ready < cache->bus_free_at) {
+            ready = cache->bus_free_at;
+        }
+        ready += transfer;
+        cache->bus_free_at = ready;
     }
-    return cache_line_retrieve_data(resulting_line, offset);
+
+    // Accesses are issued in order, so the cycles with a fill in flight
+    // grow by whatever part of this fill lies past the previous ones.
+    cache->mshr_occupancy_cycles += ready - cache->now;
+    if (ready > cache->outstanding_until) {
+        uint64_t start = cache->now > cache->outstanding_until ? cache->now : cache->outstanding_until;
+        cache->outstanding_cycles += ready - start;
+        cache->outstanding_until = ready;
     }
+
+    cache->mshrs[cache->mshr_count].address = address;
+    cache->mshrs[cache->mshr_count].ready = ready;
+    cache->mshr_count++;
 }
 
 /*
- * Write a single integer to the cache.
+ * Write the dirty sectors of a line back to memory and clear its dirty
+ * bits, and its valid bits too when invalidate is set. The address is
+ * that of the first byte of the block.
  */
-void cache_write(cache_t *cache, uintptr_t address, long value, func_t generate_random_number) {
-    /* OPTIONAL FUNCTION, YOU ARE NOT REQUIRED TO IMPLEMENT IT */
+static void cache_line_write_back(cache_t *cache, cache_line_t *line, uintptr_t address,
+                                  int invalidate) {
+    uint8_t *block = cache_line_block(cache, line);
+
+    for (unsigned int w = 0; w < cache->sector_words; w++) {
+        uint64_t dirty = cache_line_sector_word(cache, line, 1, w);
+        while (dirty != 0) {
+            size_t sector_offset = (w * 64 + __builtin_ctzll(dirty)) * cache->sector_size;
+            if (block != NULL) {
+                memcpy((void *)(address + sector_offset), block + sector_offset, cache->sector_size);
+            }
+            cache->bytes_written += cache->sector_size;
+            cache->busy_cycles += cache->timing.writeback_cost;
+            if (cache->timing.nonblocking) {
+                // Write-backs are buffered but hold up later fills.
+                uint64_t start = cache->now > cache->bus_free_at ? cache->now : cache->bus_free_at;
+                cache->bus_free_at = start + cache->timing.writeback_cost;
+            }
+            dirty &= dirty - 1;
+        }
+        if (invalidate) {
+            cache_line_set_sector_word(cache, line, 0, w, 0);
+        }
+        cache_line_set_sector_word(cache, line, 1, w, 0);
+    }
 }
 
 /*
- * Return the number of cache misses since the cache was created.
+ * Account for fetching one sector from memory at the given address: the
+ * bytes moved, the miss penalty and bus time, and in non-blocking mode
+ * the MSHR that tracks it.
  */
-int cache_miss_count(cache_t *cache) {
-
-    return cache->miss_count;
+static void cache_fetch(cache_t *cache, uintptr_t address) {
+    cache->bytes_fetched += cache->sector_size;
+    cache->miss_latency_cycles += cache->timing.miss_penalty;
+    cache->busy_cycles += cache_transfer_cycles(cache, cache->sector_size);
+    if (cache->timing.nonblocking) {
+        cache_mshr_issue(cache, address);
+    }
 }
 
 /*
- * Return the number of cache accesses since the cache was created.
+ * Make sure the sector holding the given block offset has been fetched
+ * into the line. The address is that of the first byte of the block.
+ * Returns 1 if the sector had to be fetched from memory, 0 otherwise.
+ *
+ * A fetch costs the miss penalty, which may overlap with other misses,
+ * plus the time to transfer the sector, which may not.
  */
-int cache_access_count(cache_t *cache) {
+static int cache_line_fetch_sector(cache_t *cache, cache_line_t *line,
+                                   uintptr_t address, size_t offset) {
+    unsigned int sector = cache_divide(&cache->sector_divisor, offset);
+    uint64_t bit = (uint64_t)1 << (sector & 63);
 
-    return cache->access_count;
+    size_t sector_offset = sector * cache->sector_size;
+    uint64_t valid = cache_line_sector_word(cache, line, 0, sector >> 6);
+
+    if (valid & bit) {
+        // A hit on a sector still being filled is a secondary miss.
+        if (cache->timing.nonblocking && cache_mshr_find(cache, address + sector_offset)) {
+            cache->coalesced_count++;
+        }
+        return 0;
+    }
+
+    uint8_t *block = cache_line_block(cache, line);
+    if (block != NULL) {
+        memcpy(block + sector_offset, (void *)(address + sector_offset), cache->sector_size);
+    }
+    cache_line_set_sector_word(cache, line, 0, sector >> 6, valid | bit);
+    cache_fetch(cache, address + sector_offset);
+    return 1;
+}
+
+/*
+ * Return whether bypass prediction is in use. It is suspended while
+ * cache_opt_replay drives replacement.
+ */
+static int cache_bypass_enabled(cache_t *cache) {
+    return cache->bypass_counters != NULL && cache->next_use == NULL;
+}
+
+/*
+ * Return the bypass signature of an access: a hash of its PC, or of its
+ * 4KB region if it has none.
+ */
+static unsigned int cache_bypass_signature(const cache_access_t *access) {
+    uint64_t key = access->pc != 0 ? access->pc : access->address >> CACHE_BYPASS_REGION_SHIFT;
+    return (key * 0x9E3779B97F4A7C15ULL) >> (64 - CACHE_BYPASS_SIGNATURE_BITS);
+}
+
+/*
+ * Decide whether a miss with the given signature bypasses the cache. A
+ * bypassed block goes into the ghost, and a later miss on it while it is
+ * still there shows the bypass was wrong.
+ */
+static int cache_bypass(cache_t *cache, cache_set_t *cache_set, uintptr_t address,
+                        unsigned int signature, func_t generate_random_number) {
+    cache_line_t *ghost = cache_probe(cache->bypass_ghost, address, 0);
+    if (ghost != NULL) {
+        cache->bypass_reuse_count++;
+        cache_line_set_state(ghost, CACHE_LINE_INVALID);
+    }
+
+    if (cache->bypass_counters[signature] > 0 || (cache_set - cache->sets) % CACHE_BYPASS_SAMPLE == 0) {
+        return 0;
+    }
+    cache->bypass_count++;
+    cache_lookup(cache->bypass_ghost, address, generate_random_number);
+    return 1;
+}
+
+/*
+ * Train the bypass counters on a hit, or on the eviction of a line.
+ */
+static void cache_bypass_hit(cache_t *cache, size_t line_index) {
+    uint8_t *counter = &cache->bypass_counters[cache->line_signatures[line_index]];
+    if (*counter < CACHE_BYPASS_COUNTER_MAX) {
+        (*counter)++;
+    }
+    cache->line_reused[line_index] = 1;
+}
+
+static void cache_bypass_evict(cache_t *cache, size_t line_index) {
+    uint8_t *counter = &cache->bypass_counters[cache->line_signatures[line_index]];
+    if (!cache->line_reused[line_index]) {
+        cache->dead_eviction_count++;
+        if (*counter > 0) {
+            (*counter)--;
+        }
+    }
+}
+
+/*
+ * Add a block to a given cache set. The address is that of the first
+ * byte of the block; only the sector holding the given offset is
+ * fetched, the others are filled in as they are accessed.
+ */
+static cache_line_t *cache_set_add(cache_t *cache, cache_set_t *cache_set, uintptr_t address,
+                                   size_t offset, uintptr_t tag, func_t generate_random_number) {
+    // First locate the cache line to use.
+    cache_line_t *line = find_available_cache_line(cache, cache_set, generate_random_number);
+
+    // Write back whatever the victim had modified. Its block number is
+    // rebuilt from its tag and the index of the set.
+    if (cache_line_state(line) != CACHE_LINE_INVALID) {
+        uintptr_t victim = (cache_line_tag(cache, line) * cache->num_sets + (cache_set - cache->sets)) * cache->line_size;
+        cache_line_write_back(cache, line, victim, 1);
+        if (cache_bypass_enabled(cache)) {
+            cache_bypass_evict(cache, line - cache->lines);
+        }
+    }
+
+    // Now set it up. Only lines holding an escaped tag have an entry in
+    // the table of full tags.
+    uint32_t code = cache_tag_code(cache, tag, 1);
+    if (code == CACHE_TAG_ESCAPE) {
+        cache_escaped_tag_set(cache, line - cache->lines, tag);
+    } else if ((line->bits & CACHE_LINE_TAG_MASK) == CACHE_TAG_ESCAPE) {
+        cache_escaped_tag_remove(cache, line - cache->lines);
+    }
+    line->bits = (line->bits & (CACHE_LINE_SECTOR_VALID | CACHE_LINE_SECTOR_DIRTY)) | code
+                 | (uint32_t)CACHE_LINE_EXCLUSIVE << CACHE_LINE_STATE_SHIFT;
+    cache_line_fetch_sector(cache, line, address, offset);
+
+    // And return it.
+    return line;
+}
+
+/*
+ * Draw from the random number stream of the set being accessed
+ * (splitmix64).
+ */
+static int cache_set_random(void) {
+    uint64_t z = (*cache_random_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return (int)((z ^ (z >> 31)) >> 33);
+}
+
+/*
+ * Look up the line for an access to an address with the given block
+ * number, allocating it on a miss when allocate is set, and fetch the
+ * sector the address falls in. Returns NULL on a miss that did not
+ * allocate, or that was predicted dead and bypassed the cache.
+ */
+static cache_line_t *cache_access(cache_t *cache, const cache_access_t *access, uint64_t block,
+                                  size_t *offset, int allocate, func_t generate_random_number) {
+    uintptr_t address = access->address;
+    unsigned int index;
+    uintptr_t tag;
+    cache_decode(cache, address, block, offset, &index, &tag);
+    if (cache->observer != NULL) {
+        cache->observer(cache->observer_context, block);
+    }
+    if (cache->set_random != NULL) {
+        cache_random_state = &cache->set_random[index];
+        generate_random_number = cache_set_random;
+    }
+
+    cache_set_t *cache_set = &cache->sets[index];
+    cache_line_t *line = cache_set_find_matching_line(cache, cache_set, tag);
+    cache->access_count++;
+    cache->changes++;
+    cache->busy_cycles += cache->timing.hit_latency;
+    if (cache->timing.nonblocking) {
+        cache->now += cache->timing.hit_latency;
+        cache_mshr_retire(cache);
+    }
+    if (cache->class_masks != NULL) {
+        cache->access_class = access->class_id < CACHE_MAX_CLASSES ? access->class_id : 0;
+        cache->class_stats[cache->access_class].accesses++;
+        if (line == NULL) {
+            cache->class_stats[cache->access_class].misses++;
+        }
+    }
+
+    // cache line is not in cache
+    if (line == NULL) {
+        cache->miss_count++;
+        cache_set_record_miss(cache, cache_set);
+        if ((cache->policies & CACHE_TRACE_MASK) == CACHE_TRACEPOLICY) {
+            fprintf(stderr, "Cache miss in set %3u for address 0x%" PRIxPTR "\n", index, address);
+        }
+        if (!allocate) {
+            return NULL;
+        }
+        unsigned int signature = 0;
+        if (cache_bypass_enabled(cache)) {
+            signature = cache_bypass_signature(access);
+            if (cache_bypass(cache, cache_set, address, signature, generate_random_number)) {
+                unsigned int sector = cache_divide(&cache->sector_divisor, *offset);
+                cache_fetch(cache, address - *offset + sector * cache->sector_size);
+                return NULL;
+            }
+        }
+
+        line = cache_set_add(cache, cache_set, address - *offset, *offset, tag, generate_random_number);
+        if (cache_bypass_enabled(cache)) {
+            cache->line_signatures[line - cache->lines] = signature;
+            cache->line_reused[line - cache->lines] = 0;
+        }
+        if (cache->line_classes != NULL) {
+            cache->line_classes[line - cache->lines] = cache->access_class;
+        }
+        return line;
+    }
+
+    // cache line is in cache, but the sector may not be
+    if ((cache->policies & CACHE_TRACE_MASK) == CACHE_TRACEPOLICY) {
+        fprintf(stderr, "Cache  hit in set %3u for address 0x%" PRIxPTR "\n", index, address);
+    }
+    if (cache_bypass_enabled(cache)) {
+        cache_bypass_hit(cache, line - cache->lines);
+    }
+    if (cache_line_fetch_sector(cache, line, address - *offset, *offset)) {
+        cache->sector_miss_count++;
+    }
+    return line;
+}
+
+/*
+ * Return the word a read found at the given offset of its line, or read
+ * it straight from memory if the read bypassed the cache.
+ */
+static long cache_read_result(cache_t *cache, cache_line_t *line, uintptr_t address, size_t offset) {
+    if (line == NULL) {
+        return cache->memory != NULL ? *(uint32_t *)address : 0;
+    }
+    return cache_line_retrieve_data(cache, line, offset);
+}
+
+/*
+ * Read a single long integer from the cache.
+ */
+long cache_read(cache_t *cache, uintptr_t address, func_t generate_random_number) {
+    return cache_read_block(cache, address, cache_block_number(cache, address), generate_random_number);
+}
+
+/*
+ * Read a single long integer from the cache, given the block number of
+ * the address.
+ */
+long cache_read_block(cache_t *cache, uintptr_t address, uint64_t block,
+                      func_t generate_random_number) {
+    cache_access_t access = { .address = address };
+    size_t offset;
+    cache_line_t *line = cache_access(cache, &access, block, &offset, 1, generate_random_number);
+    return cache_read_result(cache, line, address, offset);
+}
+
+/*
+ * Read a single long integer from the cache for an access described in
+ * full.
+ */
+long cache_read_access(cache_t *cache, const cache_access_t *access, func_t generate_random_number) {
+    size_t offset;
+    cache_line_t *line = cache_access(cache, access, cache_block_number(cache, access->address),
+                                      &offset, 1, generate_random_number);
+    return cache_read_result(cache, line, access->address, offset);
+}
+
+/*
+ * Access the block of an address as cache_read would, and return
+ * whether its tag was found.
+ */
+int cache_lookup(cache_t *cache, uintptr_t address, func_t generate_random_number) {
+    cache_access_t access = { .address = address };
+    uint64_t misses = cache->miss_count;
+    size_t offset;
+
+    cache_access(cache, &access, cache_block_number(cache, address), &offset, 1, generate_random_number);
+    return cache->miss_count == misses;
+}
+
+/*
+ * Make one access of a replay and return 1 if it hit.
+ */
+static inline int cache_replay_access(cache_t *cache, uintptr_t address, uint64_t block,
+                                      func_t generate_random_number) {
+    cache_access_t access = { .address = address };
+    uint64_t misses = cache->miss_count;
+    size_t offset;
+
+    cache_access(cache, &access, block, &offset, 1, generate_random_number);
+    return cache->miss_count == misses;
+}
+
+/*
+ * Replay a batch of addresses through the cache.
+ */
+size_t cache_replay(cache_t *cache, const uint64_t *addresses, size_t count, uint8_t *hits,
+                    uint64_t *set_hits, uint64_t *set_misses, func_t generate_random_number) {
+    size_t total = 0;
+
+    if (generate_random_number == NULL) {
+        generate_random_number = rand;
+    }
+    size_t line_metadata = sizeof(cache_line_t) + sizeof(int)
+                           + (cache->sector_bits != NULL ? 2 * cache->sector_words * sizeof(uint64_t) : 0);
+    size_t lookahead = (size_t)cache->num_lines * line_metadata >= CACHE_REPLAY_PREFETCH_BYTES
+                       ? CACHE_REPLAY_PREFETCH_DISTANCE : 0;
+
+    for (size_t i = 0; i < count; i++) {
+        // Replay is bound by the latency of fetching each set's metadata
+        // once it outgrows the host's caches. Its lines and recency list
+        // are found from the set index alone, so those of an access a
+        // few ahead are prefetched and their fetches overlap. Accesses
+        // are still made one at a time in order, so results are
+        // unchanged. (The prefetches are written out here: GCC drops
+        // calls to a function that does nothing but prefetch.)
+        if (lookahead != 0 && i + lookahead < count) {
+            uint64_t ahead = cache_block_number(cache, addresses[i + lookahead]);
+            size_t first = (ahead - cache_divide(&cache->set_divisor, ahead) * cache->num_sets)
+                           * cache->associativity;
+            const char *lines = (const char *)&cache->lines[first];
+            size_t size = cache->associativity * sizeof(cache_line_t);
+            for (size_t b = 0; b < size; b += 64) {
+                __builtin_prefetch(lines + b);
+            }
+            __builtin_prefetch(lines + size - 1);
+            __builtin_prefetch(&cache->sets[first / cache->associativity]);
+            __builtin_prefetch(&cache->mru_lists[first]);
+            if (cache->sector_bits != NULL) {
+                __builtin_prefetch(&cache->sector_bits[first * 2 * cache->sector_words]);
+            }
+        }
+
+        uint64_t block = cache_block_number(cache, addresses[i]);
+        int hit = cache_replay_access(cache, addresses[i], block, generate_random_number);
+        total += hit;
+        if (hits != NULL) {
+            hits[i] = hit;
+        }
+        if (set_hits != NULL || set_misses != NULL) {
+            unsigned int index = block - cache_divide(&cache->set_divisor, block) * cache->num_sets;
+            uint64_t *counts = hit ? set_hits : set_misses;
+            if (counts != NULL) {
+                counts[index]++;
+            }
+        }
+    }
+    return total;
+}
+
+/*
+ * Replay a batch of addresses through the cache set by set.
+ */
+int cache_replay_by_set(cache_t *cache, const uint64_t *addresses, size_t count, uint8_t *hits,
+                        uint64_t *set_hits, uint64_t *set_misses) {
+    int replacement = cache->policies & CACHE_REPLACEMENTPOLICY_MASK;
+    int insertion = cache->policies & CACHE_INSERTIONPOLICY_MASK;
+    if (replacement == CACHE_REPLACEMENTPOLICY_ADAPTIVE || insertion == CACHE_INSERTIONPOLICY_DIP
+        || cache_bypass_enabled(cache) || cache->timing.nonblocking || cache->observer != NULL) {
+        return -1;
+    }
+    if ((replacement == CACHE_REPLACEMENTPOLICY_RANDOM || insertion == CACHE_INSERTIONPOLICY_BIP)
+        && cache->set_random == NULL) {
+        return -1;
+    }
+
+    size_t chunk = count < CACHE_BUCKET_CHUNK ? count : CACHE_BUCKET_CHUNK;
+    uint64_t *sorted = (uint64_t *)malloc((chunk > 0 ? chunk : 1) * sizeof(uint64_t));
+    uint32_t *positions = (uint32_t *)malloc((chunk > 0 ? chunk : 1) * sizeof(uint32_t));
+    uint32_t *indices = (uint32_t *)malloc((chunk > 0 ? chunk : 1) * sizeof(uint32_t));
+    size_t *ends = (size_t *)malloc(((size_t)cache->num_sets + 1) * sizeof(size_t));
+
+    for (size_t start = 0; start < count; start += chunk) {
+        size_t n = count - start < chunk ? count - start : chunk;
+
+        // Counting sort of the chunk by set index into sorted, with each
+        // address's position in the chunk. It is stable, so each set's
+        // accesses stay in trace order. ends[s] starts as the first slot
+        // of set s and is left one past its last.
+        memset(ends, 0, ((size_t)cache->num_sets + 1) * sizeof(size_t));
+        for (size_t i = 0; i < n; i++) {
+            uint64_t block = cache_block_number(cache, addresses[start + i]);
+            indices[i] = block - cache_divide(&cache->set_divisor, block) * cache->num_sets;
+            ends[indices[i] + 1]++;
+        }
+        for (unsigned int s = 0; s < cache->num_sets; s++) {
+            ends[s + 1] += ends[s];
+        }
+        for (size_t i = 0; i < n; i++) {
+            size_t slot = ends[indices[i]]++;
+            sorted[slot] = addresses[start + i];
+            positions[slot] = i;
+        }
+
+        // The draws come from the sets' own streams when there are any,
+        // and nothing else draws, so the function is never called.
+        size_t slot = 0;
+        for (unsigned int s = 0; s < cache->num_sets; s++) {
+            for (; slot < ends[s]; slot++) {
+                int hit = cache_replay_access(cache, sorted[slot], cache_block_number(cache, sorted[slot]), rand);
+                if (hits != NULL) {
+                    hits[start + positions[slot]] = hit;
+                }
+                uint64_t *counts = hit ? set_hits : set_misses;
+                if (counts != NULL) {
+                    counts[s]++;
+                }
+            }
+        }
+    }
+
+    free(sorted);
+    free(positions);
+    free(indices);
+    free(ends);
+    return 0;
+}
+
+/*
+ * Return the block number of an address.
+ */
+uint64_t cache_block_number(cache_t *cache, uintptr_t address) {
+
+    return cache_divide(&cache->line_divisor, address);
+}
+
+/*
+ * Write a single integer to the cache.
+ */
+void cache_write(cache_t *cache, uintptr_t address, long value, func_t generate_random_number) {
+    int allocate = (cache->policies & CACHE_WRITEPOLICY_WRITENOALLOCATE) == 0;
+    int write_back = (cache->policies & CACHE_WRITEPOLICY_WRITEBACK) != 0;
+    cache_access_t access = { .address = address };
+    size_t offset;
+    cache_line_t *line = cache_access(cache, &access, cache_block_number(cache, address),
+                                      &offset, allocate, generate_random_number);
+
+    if (line != NULL) {
+        uint8_t *block = cache_line_block(cache, line);
+        if (block != NULL) {
+            *(uint32_t *)&block[offset] = value;
+        }
+        if (write_back) {
+            unsigned int sector = cache_divide(&cache->sector_divisor, offset);
+            uint64_t dirty = cache_line_sector_word(cache, line, 1, sector >> 6);
+            cache_line_set_sector_word(cache, line, 1, sector >> 6, dirty | (uint64_t)1 << (sector & 63));
+            return;
+        }
+    }
+
+    // Write-through, or a write miss that did not allocate.
+    if (cache->memory != NULL) {
+        *(uint32_t *)address = value;
+    }
+    cache->bytes_written += sizeof(uint32_t);
+}
+
+/*
+ * Return the line holding the block of an address, without counting an
+ * access or changing recency.
+ */
+cache_line_t *cache_probe(cache_t *cache, uintptr_t address, int include_invalid) {
+    size_t offset;
+    unsigned int index;
+    uintptr_t tag;
+    cache_decode(cache, address, cache_block_number(cache, address), &offset, &index, &tag);
+
+    uint32_t code = cache_tag_code(cache, tag, 0);
+    if (code == CACHE_TAG_ABSENT) {
+        return NULL;
+    }
+    cache_set_t *cache_set = &cache->sets[index];
+    for (int i = 0; i < cache_set->size; i++) {
+        cache_line_t *line = &cache_set->lines[cache_set->first_index + i];
+        if (cache_line_holds(cache, line, code, tag) && (include_invalid || cache_line_state(line) != CACHE_LINE_INVALID)) {
+            return line;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Write back the dirty sectors of a cached block, as another cache
+ * snooping it would force, and invalidate it if asked to.
+ */
+cache_line_t *cache_snoop(cache_t *cache, uintptr_t address, int invalidate) {
+    cache_line_t *line = cache_probe(cache, address, 0);
+    if (line == NULL) {
+        return NULL;
+    }
+
+    uintptr_t block = cache_block_number(cache, address) * cache->line_size;
+    cache->changes++;
+    cache_line_write_back(cache, line, block, invalidate);
+    if (invalidate) {
+        cache_line_set_state(line, CACHE_LINE_INVALID);
+    }
+    return line;
+}
+
+/*
+ * Write the whole buffer to a file descriptor, retrying short writes.
+ */
+static int cache_file_write(int fd, const void *buffer, size_t size) {
+    const uint8_t *bytes = buffer;
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0) {
+            return -1;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return 0;
+}
+
+/*
+ * Fill the whole buffer from a file descriptor, retrying short reads.
+ * A buffer of NULL skips the bytes instead.
+ */
+static int cache_file_read(int fd, void *buffer, size_t size) {
+    uint8_t scratch[4096];
+    uint8_t *bytes = buffer;
+    while (size > 0) {
+        size_t chunk = size;
+        if (buffer == NULL && chunk > sizeof(scratch)) {
+            chunk = sizeof(scratch);
+        }
+        ssize_t got = read(fd, buffer != NULL ? bytes : scratch, chunk);
+        if (got <= 0) {
+            return -1;
+        }
+        if (buffer != NULL) {
+            bytes += got;
+        }
+        size -= got;
+    }
+    return 0;
+}
+
+/*
+ * Return the size of the sector bitmaps, 0 if the cache is not sectored.
+ */
+static size_t cache_file_sector_bytes(cache_t *cache) {
+    if (cache->sector_bits == NULL) {
+        return 0;
+    }
+    return (size_t)cache->num_lines * cache->sector_words * 2 * sizeof(uint64_t);
+}
+
+/*
+ * Return the size of the mappable part of a snapshot: the recency
+ * lists, the sector bitmaps and, if saved, the block data.
+ */
+static size_t cache_file_mapping_size(cache_t *cache, int with_data) {
+    size_t size = (size_t)cache->num_lines * sizeof(int) + cache_file_sector_bytes(cache);
+    if (with_data) {
+        size += (size_t)cache->num_lines * cache->line_size;
+    }
+    return size;
+}
+
+/*
+ * Fill in the header of a snapshot of the cache.
+ */
+static void cache_file_header(cache_t *cache, int flags, cache_file_header_t *header) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    int with_data = (flags & CACHE_SAVE_DATA) && cache->memory != NULL;
+
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CACHE_FILE_MAGIC, sizeof(CACHE_FILE_MAGIC));
+    header->version = CACHE_FILE_VERSION;
+    header->flags = with_data ? CACHE_SAVE_DATA : 0;
+    header->line_size = cache->line_size;
+    header->sector_size = cache->sector_size;
+    header->associativity = cache->associativity;
+    header->num_lines = cache->num_lines;
+    header->policies = cache->policies;
+    header->access_count = cache->access_count;
+    header->miss_count = cache->miss_count;
+    header->sector_miss_count = cache->sector_miss_count;
+    header->bytes_fetched = cache->bytes_fetched;
+    header->bytes_written = cache->bytes_written;
+    header->timing = cache->timing;
+    header->busy_cycles = cache->busy_cycles;
+    header->miss_latency_cycles = cache->miss_latency_cycles;
+    header->now = cache->now;
+    header->bus_free_at = cache->bus_free_at;
+    header->outstanding_until = cache->outstanding_until;
+    header->coalesced_count = cache->coalesced_count;
+    header->mshr_stall_count = cache->mshr_stall_count;
+    header->mshr_stall_cycles = cache->mshr_stall_cycles;
+    header->mshr_occupancy_cycles = cache->mshr_occupancy_cycles;
+    header->outstanding_cycles = cache->outstanding_cycles;
+    header->psel = cache->psel;
+    header->dip_psel = cache->dip_psel;
+    header->bip_throttle = cache->bip_throttle;
+    memcpy(header->tag_regions, cache->tag_regions, sizeof(header->tag_regions));
+    header->tag_windows = cache->tag_windows;
+    header->escaped = cache->escaped_count;
+
+    // The lines and the entries of the table of escaped tags come before
+    // the mappable part, which starts on the next page.
+    size_t line_bytes = (size_t)cache->num_lines * sizeof(cache_line_t);
+    size_t escaped_bytes = cache->escaped_count * sizeof(cache_escaped_tag_t);
+    header->mapping_offset = (sizeof(*header) + line_bytes + escaped_bytes + page - 1) / page * page;
+}
+
+/*
+ * Write everything in a snapshot before the mappable part: the header,
+ * the lines, the escaped tags and the padding up to the page boundary.
+ */
+static int cache_file_write_metadata(cache_t *cache, int fd, const cache_file_header_t *header) {
+    size_t line_bytes = (size_t)cache->num_lines * sizeof(cache_line_t);
+    size_t escaped_bytes = cache->escaped_count * sizeof(cache_escaped_tag_t);
+
+    if (cache_file_write(fd, header, sizeof(*header)) < 0) {
+        return -1;
+    }
+
+    int result = cache_file_write(fd, cache->lines, line_bytes);
+    if (result == 0 && cache->escaped_count != 0) {
+        cache_escaped_tag_t *entries = (cache_escaped_tag_t *)malloc(escaped_bytes);
+        size_t count = 0;
+        for (size_t i = 0; i < cache->escaped_capacity; i++) {
+            if (cache->escaped_tags[i].line != 0) {
+                entries[count++] = cache->escaped_tags[i];
+            }
+        }
+        result = cache_file_write(fd, entries, escaped_bytes);
+        free(entries);
+    }
+
+    if (result == 0) {
+        uint8_t *padding = calloc(1, sysconf(_SC_PAGESIZE));
+        result = cache_file_write(fd, padding, header->mapping_offset - sizeof(*header) - line_bytes - escaped_bytes);
+        free(padding);
+    }
+    return result;
+}
+
+/*
+ * Write the mappable part of a snapshot: the recency lists, the sector
+ * bitmaps and, if the header says so, the block data.
+ */
+static int cache_file_write_mapped(cache_t *cache, int fd, const cache_file_header_t *header) {
+    int result = cache_file_write(fd, cache->mru_lists, (size_t)cache->num_lines * sizeof(int));
+    if (result == 0) {
+        result = cache_file_write(fd, cache->sector_bits, cache_file_sector_bytes(cache));
+    }
+    if (result == 0 && (header->flags & CACHE_SAVE_DATA)) {
+        result = cache_file_write(fd, cache->memory, (size_t)cache->num_lines * cache->line_size);
+    }
+    return result;
+}
+
+/*
+ * Write a snapshot of the cache to a file descriptor.
+ */
+int cache_save(cache_t *cache, int fd, int flags) {
+    cache_file_header_t header;
+
+    cache_file_header(cache, flags, &header);
+    if (cache_file_write_metadata(cache, fd, &header) < 0) {
+        return -1;
+    }
+    return cache_file_write_mapped(cache, fd, &header);
+}
+
+/*
+ * Create a cache from a snapshot.
+ */
+cache_t *cache_load(int fd) {
+    cache_file_header_t header;
+    size_t page = sysconf(_SC_PAGESIZE);
+    off_t start = lseek(fd, 0, SEEK_CUR);
+
+    if (cache_file_read(fd, &header, sizeof(header)) < 0
+        || memcmp(header.magic, CACHE_FILE_MAGIC, sizeof(CACHE_FILE_MAGIC)) != 0
+        || header.version != CACHE_FILE_VERSION || header.tag_windows > CACHE_TAG_WINDOWS) {
+        return NULL;
+    }
+
+    // Check the geometry before sizing anything from it.
+    if (header.line_size < sizeof(uint32_t) || header.num_lines == 0 || header.num_lines > INT_MAX
+        || header.associativity == 0 || header.associativity > header.num_lines
+        || header.sector_size < sizeof(uint32_t) || header.sector_size > header.line_size
+        || header.line_size > SIZE_MAX / header.num_lines || header.escaped > header.num_lines) {
+        return NULL;
+    }
+
+    // A regular file must hold everything the header describes: a
+    // truncated snapshot would map fine and fault on first use.
+    int with_data = (header.flags & CACHE_SAVE_DATA) != 0;
+    uint64_t sectors = header.line_size / header.sector_size;
+    uint64_t sector_words = sectors > 1 ? (sectors + 63) / 64 : 0;
+    uint64_t lines_end = sizeof(header) + header.num_lines * sizeof(cache_line_t)
+                       + header.escaped * sizeof(cache_escaped_tag_t);
+    uint64_t mapped = header.num_lines * (sizeof(int) + sector_words * 2 * sizeof(uint64_t)
+                                          + (with_data ? header.line_size : 0));
+    struct stat st;
+    if (header.mapping_offset < lines_end) {
+        return NULL;
+    }
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+        && (start < 0 || (uint64_t)st.st_size < (uint64_t)start
+            || (uint64_t)st.st_size - start < header.mapping_offset
+            || (uint64_t)st.st_size - start - header.mapping_offset < mapped)) {
+        return NULL;
+    }
+
+    // Build a cache of the same geometry; a snapshot without data comes
+    // back tag-only.
+    int policies = header.policies;
+    if (!with_data) {
+        policies = (policies & ~CACHE_DATAPOLICY_MASK) | CACHE_DATAPOLICY_NODATA;
+    }
+    cache_t *cache = cache_new_sectored(header.num_lines * header.line_size, header.line_size,
+                                        header.sector_size, header.associativity, policies);
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->access_count = header.access_count;
+    cache->miss_count = header.miss_count;
+    cache->sector_miss_count = header.sector_miss_count;
+    cache->bytes_fetched = header.bytes_fetched;
+    cache->bytes_written = header.bytes_written;
+    cache_set_timing(cache, &header.timing);
+    cache->busy_cycles = header.busy_cycles;
+    cache->miss_latency_cycles = header.miss_latency_cycles;
+    cache->now = header.now;
+    cache->bus_free_at = header.bus_free_at;
+    cache->outstanding_until = header.outstanding_until;
+    cache->coalesced_count = header.coalesced_count;
+    cache->mshr_stall_count = header.mshr_stall_count;
+    cache->mshr_stall_cycles = header.mshr_stall_cycles;
+    cache->mshr_occupancy_cycles = header.mshr_occupancy_cycles;
+    cache->outstanding_cycles = header.outstanding_cycles;
+    cache->psel = header.psel;
+    cache->dip_psel = header.dip_psel;
+    cache->bip_throttle = header.bip_throttle;
+    memcpy(cache->tag_regions, header.tag_regions, sizeof(cache->tag_regions));
+    cache->tag_windows = header.tag_windows;
+
+    // Lines, and the full tags of those that escaped compression.
+    size_t line_bytes = (size_t)cache->num_lines * sizeof(cache_line_t);
+    size_t escaped_bytes = header.escaped * sizeof(cache_escaped_tag_t);
+    int result = cache_file_read(fd, cache->lines, line_bytes);
+    if (result == 0 && header.escaped != 0) {
+        cache_escaped_tag_t *entries = (cache_escaped_tag_t *)malloc(escaped_bytes);
+        result = cache_file_read(fd, entries, escaped_bytes);
+        for (size_t i = 0; result == 0 && i < header.escaped; i++) {
+            if (entries[i].line == 0 || entries[i].line > cache->num_lines) {
+                result = -1;
+            } else {
+                cache_escaped_tag_set(cache, entries[i].line - 1, entries[i].tag);
+            }
+        }
+        free(entries);
+    }
+
+    // Map the rest of the file copy-on-write in place of the arrays
+    // cache_new_sectored allocated. Descriptors that cannot be mapped,
+    // such as pipes, are read into those arrays instead.
+    size_t mapping_size = cache_file_mapping_size(cache, with_data);
+    void *mapping = MAP_FAILED;
+    if (result == 0 && start >= 0 && (start + header.mapping_offset) % page == 0) {
+        mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                       fd, start + header.mapping_offset);
+    }
+
+    if (mapping != MAP_FAILED) {
+        free(cache->mru_lists);
+        free(cache->sector_bits);
+        free(cache->memory);
+        cache->mapping = mapping;
+        cache->mapping_size = mapping_size;
+        cache->mru_lists = mapping;
+        uint8_t *bitmaps = (uint8_t *)(cache->mru_lists + cache->num_lines);
+        size_t sector_bytes = cache_file_sector_bytes(cache);
+        cache->sector_bits = sector_bytes != 0 ? (uint64_t *)bitmaps : NULL;
+        cache->memory = with_data ? bitmaps + sector_bytes : NULL;
+        lseek(fd, start + header.mapping_offset + mapping_size, SEEK_SET);
+    } else if (result == 0) {
+        result = cache_file_read(fd, NULL, header.mapping_offset - sizeof(header) - line_bytes - escaped_bytes);
+        if (result == 0) {
+            result = cache_file_read(fd, cache->mru_lists, (size_t)cache->num_lines * sizeof(int));
+        }
+        if (result == 0) {
+            result = cache_file_read(fd, cache->sector_bits, cache_file_sector_bytes(cache));
+        }
+        if (result == 0 && with_data) {
+            result = cache_file_read(fd, cache->memory, (size_t)cache->num_lines * cache->line_size);
+        }
+    }
+    if (result < 0) {
+        cache_free(cache);
+        return NULL;
+    }
+
+    // Point the sets at their new recency lists.
+    for (size_t i = 0; i < cache->num_sets; i++) {
+        cache->sets[i].mru_list = cache->mru_lists + i * cache->associativity;
+    }
+
+    return cache;
+}
+
+/*
+ * Copy into a fork the state snapshots leave out: in-flight fills,
+ * bypass prediction, way partitioning, per-set random streams and the
+ * observer. Returns 0, or -1 if memory or the ghost cache's fork ran out.
+ */
+static int cache_fork_side_state(cache_t *cache, cache_t *child) {
+    if (cache->mshr_count != 0) {
+        memcpy(child->mshrs, cache->mshrs, cache->mshr_count * sizeof(cache_mshr_t));
+        child->mshr_count = cache->mshr_count;
+    }
+
+    if (cache->bypass_counters != NULL && child->bypass_counters != NULL) {
+        memcpy(child->bypass_counters, cache->bypass_counters, (size_t)1 << CACHE_BYPASS_SIGNATURE_BITS);
+        memcpy(child->line_signatures, cache->line_signatures, cache->num_lines * sizeof(uint16_t));
+        memcpy(child->line_reused, cache->line_reused, cache->num_lines * sizeof(uint8_t));
+        child->bypass_count = cache->bypass_count;
+        child->bypass_reuse_count = cache->bypass_reuse_count;
+        child->dead_eviction_count = cache->dead_eviction_count;
+        cache_free(child->bypass_ghost);
+        child->bypass_ghost = cache_fork(cache->bypass_ghost);
+        if (child->bypass_ghost == NULL) {
+            return -1;
+        }
+    }
+
+    if (cache->class_masks != NULL) {
+        child->class_masks = (uint64_t *)malloc(CACHE_MAX_CLASSES * sizeof(uint64_t));
+        child->class_stats = (cache_class_stats_t *)malloc(CACHE_MAX_CLASSES * sizeof(cache_class_stats_t));
+        child->line_classes = (uint8_t *)malloc(cache->num_lines * sizeof(uint8_t));
+        if (child->class_masks == NULL || child->class_stats == NULL || child->line_classes == NULL) {
+            return -1;
+        }
+        memcpy(child->class_masks, cache->class_masks, CACHE_MAX_CLASSES * sizeof(uint64_t));
+        memcpy(child->class_stats, cache->class_stats, CACHE_MAX_CLASSES * sizeof(cache_class_stats_t));
+        memcpy(child->line_classes, cache->line_classes, cache->num_lines * sizeof(uint8_t));
+    }
+    child->access_class = cache->access_class;
+
+    if (cache->set_random != NULL) {
+        child->set_random = (uint64_t *)malloc((size_t)cache->num_sets * sizeof(uint64_t));
+        if (child->set_random == NULL) {
+            return -1;
+        }
+        memcpy(child->set_random, cache->set_random, (size_t)cache->num_sets * sizeof(uint64_t));
+    }
+    child->observer = cache->observer;
+    child->observer_context = cache->observer_context;
+    return 0;
+}
+
+/*
+ * Create a copy-on-write copy of a cache.
+ */
+cache_t *cache_fork(cache_t *cache) {
+    cache_file_header_t header;
+    cache_file_header(cache, CACHE_SAVE_DATA, &header);
+
+    // Take a new snapshot into an anonymous file if the mappable part
+    // may have changed since the last one, or its metadata no longer
+    // fits before it. Otherwise only the metadata is rewritten: forks map
+    // the part after it, which stays as it was. Earlier forks keep the
+    // pages of a replaced snapshot mapped after it is closed.
+    int fresh = cache->fork_fd < 0 || cache->fork_changes != cache->changes
+                || cache->fork_offset != header.mapping_offset;
+    if (fresh) {
+        int fd = memfd_create("cache-fork", MFD_CLOEXEC);
+        if (fd < 0) {
+            return NULL;
+        }
+        if (cache->fork_fd >= 0) {
+            close(cache->fork_fd);
+        }
+        cache->fork_fd = fd;
+    }
+
+    if (lseek(cache->fork_fd, 0, SEEK_SET) != 0
+        || cache_file_write_metadata(cache, cache->fork_fd, &header) != 0
+        || (fresh && cache_file_write_mapped(cache, cache->fork_fd, &header) != 0)
+        || lseek(cache->fork_fd, 0, SEEK_SET) != 0) {
+        close(cache->fork_fd);
+        cache->fork_fd = -1;
+        return NULL;
+    }
+    cache->fork_offset = header.mapping_offset;
+    cache->fork_changes = cache->changes;
+
+    cache_t *child = cache_load(cache->fork_fd);
+    if (child != NULL && cache_fork_side_state(cache, child) != 0) {
+        cache_free(child);
+        child = NULL;
+    }
+    return child;
+}
+
+/*
+ * Return the number of cache misses since the cache was created.
+ */
+uint64_t cache_miss_count(cache_t *cache) {
+
+    return cache->miss_count;
+}
+
+/*
+ * Return the number of cache accesses since the cache was created.
+ */
+uint64_t cache_access_count(cache_t *cache) {
+
+    return cache->access_count;
+}
+
+/*
+ * Return the number of sector misses since the cache was created.
+ */
+uint64_t cache_sector_miss_count(cache_t *cache) {
+
+    return cache->sector_miss_count;
+}
+
+/*
+ * Return the number of bytes fetched from memory since the cache was created.
+ */
+uint64_t cache_bytes_fetched(cache_t *cache) {
+
+    return cache->bytes_fetched;
+}
+
+/*
+ * Return the number of bytes written to memory since the cache was created.
+ */
+uint64_t cache_bytes_written(cache_t *cache) {
+
+    return cache->bytes_written;
+}
+
+/*
+ * Set the timing model used for the cycle estimate.
+ */
+void cache_set_timing(cache_t *cache, const cache_timing_t *timing) {
+
+    cache->timing = *timing;
+
+    // Fills in flight under the old model are dropped.
+    free(cache->mshrs);
+    cache->mshrs = malloc(cache_mshr_limit(cache) * sizeof(cache_mshr_t));
+    cache->mshr_count = 0;
+}
+
+/*
+ * Return the estimated number of cycles spent in the cache: the busy
+ * cycles plus the miss latency, spread across the MSHRs.
+ */
+uint64_t cache_cycle_estimate(cache_t *cache) {
+    unsigned int mshrs = cache_mshr_limit(cache);
+
+    if (cache->timing.nonblocking) {
+        return cache->now > cache->outstanding_until ? cache->now : cache->outstanding_until;
+    }
+    return cache->busy_cycles + (cache->miss_latency_cycles + mshrs - 1) / mshrs;
+}
+
+/*
+ * Return the average memory access time in cycles.
+ */
+double cache_amat(cache_t *cache) {
+    if (cache->access_count == 0) {
+        return 0.0;
+    }
+    return (double)cache_cycle_estimate(cache) / cache->access_count;
+}
+
+/*
+ * Return the number of coalesced secondary misses.
+ */
+int cache_coalesced_count(cache_t *cache) {
+
+    return cache->coalesced_count;
+}
+
+/*
+ * Return the number of MSHR-full stalls.
+ */
+int cache_mshr_stall_count(cache_t *cache) {
+
+    return cache->mshr_stall_count;
+}
+
+/*
+ * Return the memory-level parallelism.
+ */
+double cache_mlp(cache_t *cache) {
+    if (cache->outstanding_cycles == 0) {
+        return 0.0;
+    }
+    return (double)cache->mshr_occupancy_cycles / cache->outstanding_cycles;
+}
+
+/*
+ * Hash table from block number to the position of its next use, used by
+ * the backward pass of cache_opt_replay.
+ */
+typedef struct cache_opt_table_s {
+    uint64_t *keys;     // block number + 1, 0 marking an empty slot
+    uint64_t *positions;
+    size_t capacity, count;
+} cache_opt_table_t;
+
+/*
+ * Return the slot of a block in the table: either the one holding it or
+ * the empty one where it belongs.
+ */
+static size_t cache_opt_slot(cache_opt_table_t *table, uint64_t block) {
+    uint64_t key = block + 1;
+    size_t mask = table->capacity - 1;
+    size_t slot = (key * 0x9E3779B97F4A7C15ULL) >> 20 & mask;
+
+    while (table->keys[slot] != 0 && table->keys[slot] != key) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/*
+ * Return the position of the next use of a block (UINT64_MAX if there is
+ * none) and record an earlier use at the given position, growing the
+ * table when it gets half full.
+ */
+static uint64_t cache_opt_swap(cache_opt_table_t *table, uint64_t block, uint64_t position) {
+    size_t slot = cache_opt_slot(table, block);
+    if (table->keys[slot] != 0) {
+        uint64_t next = table->positions[slot];
+        table->positions[slot] = position;
+        return next;
+    }
+
+    if (2 * (table->count + 1) > table->capacity) {
+        uint64_t *keys = table->keys, *positions = table->positions;
+        size_t capacity = table->capacity;
+
+        table->capacity *= 2;
+        table->keys = (uint64_t *)calloc(table->capacity, sizeof(uint64_t));
+        table->positions = (uint64_t *)malloc(table->capacity * sizeof(uint64_t));
+        for (size_t i = 0; i < capacity; i++) {
+            if (keys[i] != 0) {
+                size_t moved = cache_opt_slot(table, keys[i] - 1);
+                table->keys[moved] = keys[i];
+                table->positions[moved] = positions[i];
+            }
+        }
+        free(keys);
+        free(positions);
+        slot = cache_opt_slot(table, block);
+    }
+
+    table->keys[slot] = block + 1;
+    table->positions[slot] = position;
+    table->count++;
+    return UINT64_MAX;
+}
+
+/*
+ * Replay a trace under Belady's OPT replacement.
+ */
+int cache_opt_replay(cache_t *cache, const uint64_t *addresses, size_t count, uint8_t *hits) {
+    size_t chunk = count < CACHE_OPT_CHUNK ? count : CACHE_OPT_CHUNK;
+    uint64_t *next_uses = (uint64_t *)malloc((chunk > 0 ? chunk : 1) * sizeof(uint64_t));
+    cache_opt_table_t table;
+    FILE *spill = NULL;
+    int fd = -1, result = 0;
+
+    // A trace longer than a chunk has its next uses spilled to a
+    // temporary file, chunk by chunk from the end.
+    if (count > chunk) {
+        spill = tmpfile();
+        if (spill == NULL) {
+            free(next_uses);
+            return -1;
+        }
+        fd = fileno(spill);
+    }
+
+    table.capacity = 1024;
+    table.count = 0;
+    table.keys = (uint64_t *)calloc(table.capacity, sizeof(uint64_t));
+    table.positions = (uint64_t *)malloc(table.capacity * sizeof(uint64_t));
+
+    size_t start = count;
+    while (start > 0 && result == 0) {
+        size_t n = start % chunk != 0 ? start % chunk : chunk;
+        start -= n;
+        for (size_t i = start + n; i-- > start;) {
+            next_uses[i - start] = cache_opt_swap(&table, cache_block_number(cache, addresses[i]), i);
+        }
+        if (fd >= 0) {
+            if (lseek(fd, start * sizeof(uint64_t), SEEK_SET) < 0
+                || cache_file_write(fd, next_uses, n * sizeof(uint64_t)) != 0) {
+                result = -1;
+            }
+        }
+    }
+    free(table.keys);
+    free(table.positions);
+
+    // Forward pass: each access labels its line with the next use of the
+    // block, which find_available_cache_line compares on a miss.
+    cache->next_use = (uint64_t *)malloc((size_t)cache->num_lines * sizeof(uint64_t));
+    for (unsigned int i = 0; i < cache->num_lines; i++) {
+        cache->next_use[i] = UINT64_MAX;
+    }
+    if (fd >= 0 && lseek(fd, 0, SEEK_SET) < 0) {
+        result = -1;
+    }
+
+    size_t offset;
+    for (start = 0; start < count && result == 0; start += chunk) {
+        size_t n = count - start < chunk ? count - start : chunk;
+        if (fd >= 0 && cache_file_read(fd, next_uses, n * sizeof(uint64_t)) != 0) {
+            result = -1;
+            break;
+        }
+        for (size_t i = 0; i < n; i++) {
+            cache_access_t access = { .address = addresses[start + i] };
+            uint64_t misses = cache->miss_count;
+            cache_line_t *line = cache_access(cache, &access, cache_block_number(cache, access.address),
+                                              &offset, 1, rand);
+            cache->next_use[line - cache->lines] = next_uses[i];
+            if (hits != NULL) {
+                hits[start + i] = cache->miss_count == misses;
+            }
+        }
+    }
+
+    free(cache->next_use);
+    cache->next_use = NULL;
+    free(next_uses);
+    if (spill != NULL) {
+        fclose(spill);
+    }
+    return result;
+}
+
+/*
+ * Return the number of misses that bypassed the cache.
+ */
+unsigned int cache_bypass_count(cache_t *cache) {
+    return cache->bypass_count;
+}
+
+/*
+ * Return the share of bypasses whose block was not missed again while
+ * it was in the ghost.
+ */
+double cache_bypass_accuracy(cache_t *cache) {
+    if (cache->bypass_count == 0) {
+        return 1.0;
+    }
+    return 1.0 - (double)cache->bypass_reuse_count / cache->bypass_count;
+}
+
+/*
+ * Restrict a class of service to the given ways.
+ */
+int cache_set_class_ways(cache_t *cache, unsigned int class_id, uint64_t way_mask) {
+    uint64_t all = cache->associativity >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << cache->associativity) - 1;
+    if (class_id >= CACHE_MAX_CLASSES || cache->associativity > 64 || way_mask == 0 || (way_mask & ~all) != 0) {
+        return -1;
+    }
+
+    if (cache->class_masks == NULL) {
+        cache->class_masks = (uint64_t *)malloc(CACHE_MAX_CLASSES * sizeof(uint64_t));
+        for (unsigned int i = 0; i < CACHE_MAX_CLASSES; i++) {
+            cache->class_masks[i] = all;
+        }
+        cache->class_stats = (cache_class_stats_t *)calloc(CACHE_MAX_CLASSES, sizeof(cache_class_stats_t));
+        cache->line_classes = (uint8_t *)calloc(cache->num_lines, sizeof(uint8_t));
+    }
+    cache->class_masks[class_id] = way_mask;
+    return 0;
+}
+
+/*
+ * Fill in the statistics of a class of service.
+ */
+void cache_class_stats(cache_t *cache, unsigned int class_id, cache_class_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (cache->class_stats == NULL || class_id >= CACHE_MAX_CLASSES) {
+        return;
+    }
+
+    *stats = cache->class_stats[class_id];
+    stats->occupancy = 0;
+    for (unsigned int i = 0; i < cache->num_lines; i++) {
+        if (cache_line_state(&cache->lines[i]) != CACHE_LINE_INVALID && cache->line_classes[i] == class_id) {
+            stats->occupancy++;
+        }
+    }
+}
+
+/*
+ * Set the observer of every access.
+ */
+void cache_set_observer(cache_t *cache, cache_observer_t observer, void *context) {
+    cache->observer = observer;
+    cache->observer_context = context;
+}
+
+/*
+ * Give every set its own stream of random numbers.
+ */
+void cache_set_random_streams(cache_t *cache, uint64_t seed) {
+    if (cache->set_random == NULL) {
+        cache->set_random = (uint64_t *)malloc((size_t)cache->num_sets * sizeof(uint64_t));
+    }
+    // Multiplying the set index by a large odd constant starts the
+    // streams far apart on the generator's cycle.
+    for (unsigned int i = 0; i < cache->num_sets; i++) {
+        cache->set_random[i] = seed ^ ((uint64_t)i * 0xD1B54A32D192ED03ULL);
+    }
+}
+
+/*
+ * Return the replacement policy the follower sets currently use.
+ */
+int cache_duel_winner(cache_t *cache) {
+    return cache->psel > CACHE_PSEL_MAX / 2 ? CACHE_REPLACEMENTPOLICY_MRU : CACHE_REPLACEMENTPOLICY_LRU;
+}
+
+/*
+ * Return the insertion policy the DIP follower sets currently use.
+ */
+int cache_dip_winner(cache_t *cache) {
+    return cache->dip_psel > CACHE_PSEL_MAX / 2 ? CACHE_INSERTIONPOLICY_BIP : CACHE_INSERTIONPOLICY_MRU;
+}
+
+/*
+ * Set the number of fills per MRU insertion under BIP and DIP.
+ */
+void cache_set_bip_throttle(cache_t *cache, unsigned int throttle) {
+    cache->bip_throttle = throttle > 0 ? throttle : 1;
+}
+
+/*
+ * Print the cache statistics and the timing estimate.
+ */
+void cache_report(cache_t *cache, FILE *out) {
+    double miss_ratio = cache->access_count ? (double)cache->miss_count / cache->access_count : 0.0;
+
+    fprintf(out, "accesses:         %" PRIu64 "\n", cache->access_count);
+    fprintf(out, "misses:           %" PRIu64 " (%.4f)\n", cache->miss_count, miss_ratio);
+    fprintf(out, "sector misses:    %" PRIu64 "\n", cache->sector_miss_count);
+    fprintf(out, "bytes fetched:    %" PRIu64 "\n", cache->bytes_fetched);
+    fprintf(out, "bytes written:    %" PRIu64 "\n", cache->bytes_written);
+    fprintf(out, "bytes moved:      %" PRIu64 "\n", cache->bytes_fetched + cache->bytes_written);
+    fprintf(out, "estimated cycles: %" PRIu64 "\n", cache_cycle_estimate(cache));
+    fprintf(out, "AMAT:             %.3f cycles\n", cache_amat(cache));
+    if (cache->timing.nonblocking) {
+        fprintf(out, "coalesced misses: %u\n", cache->coalesced_count);
+        fprintf(out, "MSHR stalls:      %u (%" PRIu64 " cycles)\n",
+                cache->mshr_stall_count, cache->mshr_stall_cycles);
+        fprintf(out, "MLP:              %.3f\n", cache_mlp(cache));
+    }
+    if ((cache->policies & CACHE_REPLACEMENTPOLICY_MASK) == CACHE_REPLACEMENTPOLICY_ADAPTIVE) {
+        fprintf(out, "followers:        %s (PSEL %u)\n",
+                cache_duel_winner(cache) == CACHE_REPLACEMENTPOLICY_MRU ? "MRU" : "LRU", cache->psel);
+    }
+    if ((cache->policies & CACHE_BYPASS_MASK) == CACHE_BYPASSPOLICY) {
+        fprintf(out, "bypasses:         %u (accuracy %.4f)\n", cache->bypass_count, cache_bypass_accuracy(cache));
+        fprintf(out, "dead evictions:   %u\n", cache->dead_eviction_count);
+    }
+    if (cache->class_stats != NULL) {
+        for (unsigned int i = 0; i < CACHE_MAX_CLASSES; i++) {
+            cache_class_stats_t stats;
+            cache_class_stats(cache, i, &stats);
+            if (stats.accesses == 0 && stats.occupancy == 0) {
+                continue;
+            }
+            fprintf(out, "class %2u:         ways 0x%" PRIx64 ", %" PRIu64 " accesses, %" PRIu64
+                    " misses (%.4f), %" PRIu64 " lines\n", i, cache->class_masks[i], stats.accesses,
+                    stats.misses, stats.accesses ? (double)stats.misses / stats.accesses : 0.0, stats.occupancy);
+        }
+    }
+    if ((cache->policies & CACHE_INSERTIONPOLICY_MASK) == CACHE_INSERTIONPOLICY_DIP) {
+        fprintf(out, "DIP followers:    %s insertion (PSEL %u)\n",
+                cache_dip_winner(cache) == CACHE_INSERTIONPOLICY_BIP ? "BIP" : "MRU", cache->dip_psel);
+    }
 }
@@ -11,10 +11,21 @@
 #include <time.h>
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*
  * Replacement policies. The MASK defines which bits are used to
- * represent policies. As we have three policies, we assign
- * them the values 0, 1 and 2.
+ * represent policies. As we have four policies, we assign
+ * them the values 0, 1, 2 and 3.
+ *
+ * The adaptive policy duels LRU against MRU: a few leader sets always
+ * use LRU, a few always use MRU, and a saturating counter (PSEL) moves
+ * one way on misses in the LRU leaders and the other way on misses in
+ * the MRU leaders. The remaining follower sets use whichever policy is
+ * missing less. Caches with fewer than four sets have no room for
+ * leaders and behave as LRU.
  *
  * Therefore, you can check for a specific policy using:
  * if (policy & CACHE_REPLACEMENTPOLICY_MASK == CACHE_REPLACEMENTPOLICY_LRU) { ... }
@@ -24,6 +35,15 @@
 #define CACHE_REPLACEMENTPOLICY_RANDOM 0b00000000
 #define CACHE_REPLACEMENTPOLICY_LRU    0b00000100
 #define CACHE_REPLACEMENTPOLICY_MRU    0b00001000
+#define CACHE_REPLACEMENTPOLICY_ADAPTIVE 0b00001100
+
+/*
+ * Set dueling: number of leader sets per policy, and the largest value
+ * of the 10-bit PSEL counter. Followers use MRU while PSEL is above half
+ * of it.
+ */
+#define CACHE_DUEL_LEADERS 32
+#define CACHE_PSEL_MAX     1023
 
 /*
  * Write policies: We use two bits to indicate the write policy.
@@ -38,6 +58,29 @@
 #define CACHE_WRITEPOLICY_WRITEALLOCATE      0b00000000
 #define CACHE_WRITEPOLICY_WRITENOALLOCATE    0b00000010
 
+/*
+ * Insertion policies: where a newly filled line goes in the recency
+ * list of its set, independently of which line was evicted for it. MRU
+ * is the classic choice. LIP inserts at the LRU position, so a line
+ * that is not reused is the next one evicted. BIP does the same but
+ * inserts at MRU once every bip_throttle fills, so a changing working
+ * set is still picked up. DIP duels MRU insertion against BIP with its
+ * own leader sets and PSEL counter, as the adaptive replacement policy
+ * does, and inserts at MRU in caches with fewer than four sets.
+ * Insertion has no effect on random replacement.
+ */
+#define CACHE_INSERTIONPOLICY_MASK 0b11000000
+
+#define CACHE_INSERTIONPOLICY_MRU  0b00000000
+#define CACHE_INSERTIONPOLICY_LIP  0b01000000
+#define CACHE_INSERTIONPOLICY_BIP  0b10000000
+#define CACHE_INSERTIONPOLICY_DIP  0b11000000
+
+/*
+ * Default number of fills per MRU insertion under BIP (epsilon = 1/32).
+ */
+#define CACHE_BIP_THROTTLE 32
+
 /*
  * Other policies: Do we want to use cache tracing.
  */
@@ -45,21 +88,194 @@
 #define CACHE_TRACEPOLICY 0b00010000
 
 /*
- * Structure used to store a single cache line.
+ * Bypass prediction: a miss whose block is predicted to see no reuse
+ * before eviction is served from memory without allocating a line, so
+ * streaming data does not evict the working set. Predictions come from
+ * saturating counters indexed by a signature (SHiP): the PC of the
+ * access if it has one, or else the 4KB region of its address. A hit
+ * on a line raises the counter of the signature that filled it, and the
+ * eviction of a line that was never hit lowers it; misses whose counter
+ * has reached 0 bypass. One set in CACHE_BYPASS_SAMPLE always
+ * allocates, so the counters keep learning. Bypassed blocks are kept in
+ * a tag-only ghost of the cache to measure how often a bypass was
+ * wrong. The counters are not saved in snapshots.
  */
-typedef struct cache_line_s {
+#define CACHE_BYPASS_MASK   0b100000000
+#define CACHE_BYPASSPOLICY  0b100000000
 
-    /* The valid bit. */
-    int is_valid;
-  
-    /* The tag. */
-    uintptr_t tag;
-  
-    /* The cache block as bytes */
-    uint8_t *block;
-  
+#define CACHE_BYPASS_SIGNATURE_BITS 14
+#define CACHE_BYPASS_COUNTER_MAX    7
+#define CACHE_BYPASS_REGION_SHIFT   12
+#define CACHE_BYPASS_SAMPLE         32
+
+/*
+ * Data policies: by default the cache keeps a copy of every block and
+ * reads it from (and writes it to) the address it was given. A tag-only
+ * cache keeps no data at all, so it can replay traces of addresses that
+ * are not mapped in this process; cache_read then always returns 0.
+ */
+#define CACHE_DATAPOLICY_MASK   0b00100000
+
+#define CACHE_DATAPOLICY_DATA   0b00000000
+#define CACHE_DATAPOLICY_NODATA 0b00100000
+
+/*
+ * Parameters of the timing model used to turn access counts into a
+ * cycle estimate. All latencies are in cycles.
+ */
+typedef struct cache_timing_s {
+    /* Cycles spent on every access, hit or miss. */
+    unsigned int hit_latency;
+
+    /* Cycles from requesting a fill until the first byte arrives. */
+    unsigned int miss_penalty;
+
+    /* Bytes per cycle memory delivers to a fill (0 means unlimited). */
+    unsigned int fill_bandwidth;
+
+    /* Number of misses whose penalties can overlap (0 is taken as 1). */
+    unsigned int mshrs;
+
+    /* Cycles to write back one dirty sector. */
+    unsigned int writeback_cost;
+
+    /* Non-zero to model a non-blocking cache: each access advances a
+     * clock by hit_latency, misses occupy an MSHR until their data
+     * arrives, fills share the memory bus, and the cache only stalls
+     * when every MSHR is busy. */
+    int nonblocking;
+} cache_timing_t;
+
+/*
+ * A miss status holding register: one fill in flight in a non-blocking
+ * cache, identified by the address of the sector being fetched.
+ */
+typedef struct cache_mshr_s {
+    uintptr_t address;
+    uint64_t ready;
+} cache_mshr_t;
+
+/*
+ * Precomputed divisor used to split an address into block offset, set
+ * index and tag. Powers of two reduce to a shift (magic is 0); any
+ * other divisor uses a 64-bit magic multiplier, so non-power-of-two
+ * line sizes and set counts never pay for a hardware divide.
+ */
+typedef struct cache_divisor_s {
+    /* The divisor itself. */
+    uint64_t divisor;
+
+    /* Magic multiplier, or 0 when the divisor is a power of two. */
+    uint64_t magic;
+
+    /* Final shift applied to the high half of the product. */
+    unsigned int shift;
+
+    /* Whether the magic needs the extra add-and-halve fixup. */
+    int add;
+} cache_divisor_t;
+
+/*
+ * Line states. A line is valid in any state but CACHE_LINE_INVALID; a
+ * cache on its own fills lines as exclusive, and the other states are
+ * only used when caches are kept coherent with each other (coherence.h).
+ */
+#define CACHE_LINE_INVALID   0
+#define CACHE_LINE_SHARED    1
+#define CACHE_LINE_EXCLUSIVE 2
+#define CACHE_LINE_OWNED     3
+#define CACHE_LINE_MODIFIED  4
+
+/*
+ * An access and what is known about it besides its address: the PC of
+ * the instruction that made it, or 0 if unknown, and the class of
+ * service of the tenant that made it under way partitioning.
+ */
+typedef struct cache_access_s {
+    uintptr_t address;
+    uintptr_t pc;
+    unsigned int class_id;
+} cache_access_t;
+
+/*
+ * Way partitioning, as with Intel CAT: each class of service has a mask
+ * of the ways it may fill and evict in every set, while hits are found
+ * in any way. Class ids at or above CACHE_MAX_CLASSES are taken as 0.
+ */
+#define CACHE_MAX_CLASSES 16
+
+/*
+ * Statistics of one class under way partitioning.
+ */
+typedef struct cache_class_stats_s {
+    uint64_t accesses, misses;
+
+    /* Valid lines the class filled, counted when the statistics are
+     * read. */
+    uint64_t occupancy;
+} cache_class_stats_t;
+
+/*
+ * Function called with the block number (address / line size) of every
+ * access, so an analysis such as shards.h can run alongside a replay.
+ */
+typedef void (*cache_observer_t)(void *context, uint64_t block);
+
+/*
+ * Structure used to store a single cache line, packed into 32 bits so a
+ * 16-way set's lines fit in one cache line of the host: the state, which
+ * doubles as the valid bit, in the top bits, then the valid and dirty
+ * bits of the line's sector when it has a single one, then the
+ * compressed tag in the low CACHE_LINE_TAG_BITS bits. A line's full tag,
+ * block data and, in a sectored cache, sector bitmaps are found from the
+ * cache (cache_line_tag, cache_line_block and cache_line_sectors).
+ */
+#define CACHE_LINE_TAG_BITS     27
+#define CACHE_LINE_TAG_MASK     (((uint32_t)1 << CACHE_LINE_TAG_BITS) - 1)
+#define CACHE_LINE_SECTOR_VALID ((uint32_t)1 << 27)
+#define CACHE_LINE_SECTOR_DIRTY ((uint32_t)1 << 28)
+#define CACHE_LINE_STATE_SHIFT  29
+
+typedef struct cache_line_s {
+    uint32_t bits;
 } cache_line_t;
 
+/*
+ * Tag compression. A tag is split into a region, its bits above
+ * CACHE_TAG_OFFSET_BITS, and an offset in the region. The first
+ * CACHE_TAG_WINDOWS regions filled get a window each, and their tags are
+ * stored as the window number and the offset; a trace touches few
+ * regions, each spanning at least 2^24 lines of memory. The tags of any
+ * other region are stored as CACHE_TAG_ESCAPE, the full tag going to a
+ * small hash table keyed by line index. Windows are never given back, so
+ * every tag has one encoding for the life of the cache and matching
+ * stays exact.
+ */
+#define CACHE_TAG_OFFSET_BITS 24
+#define CACHE_TAG_OFFSET_MASK (((uint32_t)1 << CACHE_TAG_OFFSET_BITS) - 1)
+#define CACHE_TAG_WINDOWS     7
+#define CACHE_TAG_ESCAPE      ((uint32_t)CACHE_TAG_WINDOWS << CACHE_TAG_OFFSET_BITS)
+
+/*
+ * Entry of the table of escaped tags: the index of a line plus one, or
+ * 0 for an empty entry, and the line's full tag.
+ */
+typedef struct cache_escaped_tag_s {
+    uint64_t line, tag;
+} cache_escaped_tag_t;
+
+/*
+ * Return the state of a line, or change it.
+ */
+static inline int cache_line_state(const cache_line_t *line) {
+    return (int)(line->bits >> CACHE_LINE_STATE_SHIFT);
+}
+
+static inline void cache_line_set_state(cache_line_t *line, int state) {
+    line->bits = (line->bits & (((uint32_t)1 << CACHE_LINE_STATE_SHIFT) - 1))
+                 | (uint32_t)state << CACHE_LINE_STATE_SHIFT;
+}
+
 /*
  * Structure used to store a cache set: a cache set contains a size
  * and a reference to the lines of the set.
@@ -88,20 +304,20 @@ typedef struct cache_s {
     /* Associativity of the cache */
     size_t associativity;
 
-    /* Mask for block offset. */
-    uintptr_t block_offset_mask;
-  
-    /* Mask for cache index. */
-    uintptr_t cache_index_mask;
-  
-    /* Shift for cache index. */
-    unsigned int cache_index_shift;
-  
-    /* Mask for tag. */
-    uintptr_t tag_mask;
+    /* Number of bytes fetched from memory at a time. */
+    size_t sector_size;
+
+    /* Number of sectors in a line, and 64-bit words per sector bitmap. */
+    unsigned int sectors_per_line, sector_words;
+
+    /* Divisor by sector size: block offset -> sector. */
+    cache_divisor_t sector_divisor;
+
+    /* Divisor by line size: address -> block number and offset. */
+    cache_divisor_t line_divisor;
   
-    /* Shift for tag. */
-    unsigned int tag_shift;
+    /* Divisor by set count: block number -> tag and set index. */
+    cache_divisor_t set_divisor;
   
     /* Replacement and write policies. */
     unsigned int policies;
@@ -109,14 +325,98 @@ typedef struct cache_s {
     /* All the memory in the cache */
     uint8_t *memory;
 
+    /* Valid and dirty bitmaps for the sectors of every line, or NULL if
+     * lines have a single sector, whose bits are in the line word. */
+    uint64_t *sector_bits;
+
     /* Array of lines, each of which is an array of bytes. */
     cache_line_t *lines;
+
+    /* Tag compression: the region of every window given out, and the
+     * full tags of the lines holding an escaped tag, in an open-addressing
+     * table of escaped_capacity entries (a power of two), or NULL until a
+     * tag escapes. */
+    uint64_t tag_regions[CACHE_TAG_WINDOWS];
+    unsigned int tag_windows;
+    cache_escaped_tag_t *escaped_tags;
+    size_t escaped_capacity, escaped_count;
   
     /* Array of sets, each of which refers to its lines */
     cache_set_t *sets;
-  
+
+    /* Recency lists of all sets, associativity entries per set. */
+    int *mru_lists;
+
+    /* Mapping holding the recency lists, sector bitmaps and memory of a
+     * cache loaded from a snapshot, or NULL. */
+    void *mapping;
+    size_t mapping_size;
+
+    /* Snapshot the caches forked from this one map, or -1, with the
+     * offset of its mappable part and the value of changes when it was
+     * taken. changes counts the operations that may have modified the
+     * recency lists, sector bitmaps or block data. */
+    int fork_fd;
+    uint64_t fork_offset, fork_changes, changes;
+
+    /* Set dueling: distance between leader sets of the same policy
+     * (0 if there are none), and the policy selectors of adaptive
+     * replacement and of DIP. */
+    unsigned int duel_spacing, psel, dip_psel;
+
+    /* BIP: number of fills per MRU insertion. */
+    unsigned int bip_throttle;
+
+    /* Offline OPT: for each line, the position in the trace of the next
+     * use of its block, or NULL outside cache_opt_replay. */
+    uint64_t *next_use;
+
+    /* Bypass prediction: the signature counters, the signature that
+     * filled each line and whether it has been hit since, the ghost of
+     * recently bypassed blocks, and the outcomes. All NULL and 0 unless
+     * CACHE_BYPASSPOLICY is set. */
+    uint8_t *bypass_counters;
+    uint16_t *line_signatures;
+    uint8_t *line_reused;
+    struct cache_s *bypass_ghost;
+    unsigned int bypass_count, bypass_reuse_count, dead_eviction_count;
+
+    /* Way partitioning: the way mask and statistics of every class, the
+     * class that filled each line, and the class being served. NULL
+     * until cache_set_class_ways is first called. */
+    uint64_t *class_masks;
+    cache_class_stats_t *class_stats;
+    uint8_t *line_classes;
+    unsigned int access_class;
+
+    /* Observer of every access and its context, or NULL. */
+    cache_observer_t observer;
+    void *observer_context;
+
+    /* State of the random number stream of every set, or NULL to draw
+     * from the function passed to each access. */
+    uint64_t *set_random;
+
     /* Statistics about cache usage. */
-    unsigned int access_count, miss_count;
+    uint64_t access_count, miss_count, sector_miss_count;
+
+    /* Bytes moved between the cache and memory. */
+    uint64_t bytes_fetched, bytes_written;
+
+    /* Timing model and the cycles accumulated so far: busy cycles
+     * cannot overlap, miss latency cycles overlap across the MSHRs. */
+    cache_timing_t timing;
+    uint64_t busy_cycles, miss_latency_cycles;
+
+    /* Non-blocking mode: the clock, the outstanding fills, the cycle
+     * the memory bus is next free, and the MSHR statistics. Occupancy
+     * sums the lifetimes of all fills; outstanding cycles count the
+     * cycles with at least one fill in flight. */
+    uint64_t now, bus_free_at, outstanding_until;
+    cache_mshr_t *mshrs;
+    unsigned int mshr_count;
+    unsigned int coalesced_count, mshr_stall_count;
+    uint64_t mshr_stall_cycles, mshr_occupancy_cycles, outstanding_cycles;
 } cache_t;
 
 typedef int (*func_t)(void);
@@ -126,40 +426,321 @@ typedef int (*func_t)(void);
 /*
  * Create a new cache that contains a total of num_bytes line, each of which is block_size
  * bytes long, with the given associativity and policies.
+ *
+ * None of the sizes needs to be a power of two. Returns NULL if the
+ * geometry is impossible: a zero size, a capacity that is not a whole
+ * number of lines, a line count that is not a whole number of sets or
+ * above INT_MAX, or a line too short to hold the 32-bit word returned by
+ * cache_read.
  */
 cache_t *cache_new(size_t num_bytes, size_t block_size, unsigned int associativity, int policies);
 
+/*
+ * Create a new sectored cache: one tag per block_size line, but data is
+ * fetched from memory (and written back) sector_size bytes at a time,
+ * with a valid and a dirty bit for every sector. sector_size must divide
+ * block_size and hold the 32-bit word returned by cache_read; cache_new
+ * is the special case sector_size == block_size.
+ */
+cache_t *cache_new_sectored(size_t num_bytes, size_t block_size, size_t sector_size,
+                            unsigned int associativity, int policies);
+
 /*
  *  Helpers
  */
-int cache_line_check_validity_and_tag(cache_line_t *cache_line, uintptr_t tag);
-long cache_line_retrieve_data(cache_line_t *cache_line, size_t offset);
+int cache_line_check_validity_and_tag(cache_t *cache, cache_line_t *cache_line, uintptr_t tag);
+long cache_line_retrieve_data(cache_t *cache, cache_line_t *cache_line, size_t offset);
 cache_line_t *cache_set_find_matching_line(cache_t *cache, cache_set_t *cache_set, uintptr_t tag);
 cache_line_t *find_available_cache_line(cache_t *cache, cache_set_t *cache_set, func_t generate_random_number);
 
+/*
+ * Return the full tag of a line, its block data, or NULL for a tag-only
+ * cache, and its sector bits: sector_words words of valid bits followed
+ * by as many of dirty bits, or NULL if the cache is not sectored and the
+ * bits are CACHE_LINE_SECTOR_VALID and CACHE_LINE_SECTOR_DIRTY of the
+ * line word.
+ */
+uintptr_t cache_line_tag(cache_t *cache, cache_line_t *line);
+uint8_t *cache_line_block(cache_t *cache, cache_line_t *line);
+uint64_t *cache_line_sectors(cache_t *cache, cache_line_t *line);
+
+/*
+ * Return the line holding the block of an address, or NULL. This is a
+ * probe: it counts no access and leaves recency alone. With
+ * include_invalid set, a line that still carries the tag after being
+ * invalidated is returned as well.
+ */
+cache_line_t *cache_probe(cache_t *cache, uintptr_t address, int include_invalid);
+
+/*
+ * Model a snoop of the block of an address: write back its dirty
+ * sectors and, if invalidate is set, mark the line invalid while keeping
+ * its tag. Returns the line, or NULL if the block is not cached.
+ */
+cache_line_t *cache_snoop(cache_t *cache, uintptr_t address, int invalidate);
+
 /*
  * Frees all memory allocated for the given cache.
  */
 void cache_free(cache_t *cache);
 
+/*
+ * Flags for cache_save: also save the contents of every block. Without
+ * it, the snapshot restores as a tag-only cache.
+ */
+#define CACHE_SAVE_DATA 0b00000001
+
+/*
+ * Write a snapshot of the cache to a file descriptor: its geometry,
+ * policies, timing model, statistics, tags, valid and sector bits and
+ * recency lists, and the block data if CACHE_SAVE_DATA is given. Fills
+ * in flight in a non-blocking cache are not saved. Returns 0 on success
+ * and -1 on error, with errno set.
+ */
+int cache_save(cache_t *cache, int fd, int flags);
+
+/*
+ * Create a cache from a snapshot written by cache_save, reading from the
+ * current position of the file descriptor. The recency lists, sector
+ * bitmaps and block data are mapped copy-on-write from the file when it
+ * can be mapped, and read otherwise; the descriptor can be closed
+ * afterwards. Returns NULL if the snapshot is invalid or cannot be read.
+ */
+cache_t *cache_load(int fd);
+
+/*
+ * Create an independent copy of the cache, for running what-if
+ * experiments from the same warm state. The recency lists, sector
+ * bitmaps and block data are saved once to an in-memory snapshot, which
+ * every copy forked until they next change maps copy-on-write: dozens of
+ * copies share its pages and only duplicate those they modify. The
+ * lines, statistics and policies, and the state of bypass prediction,
+ * way partitioning, per-set random streams and the observer, are copied
+ * for each fork. Block data or sector bits changed directly through
+ * cache_line_block or cache_line_sectors are not noticed; fork before
+ * changing them. Returns NULL on error.
+ */
+cache_t *cache_fork(cache_t *cache);
+
 /*
  * Read a single long integer from the cache.
  */
 long cache_read(cache_t *cache, uintptr_t address, func_t generate_random_number);
 
 /*
- * Write a single long integer to memory and/or the cache.
+ * Read a single long integer from the cache, as cache_read does, for an
+ * access described in full.
+ */
+long cache_read_access(cache_t *cache, const cache_access_t *access, func_t generate_random_number);
+
+/*
+ * Access the block of an address exactly as cache_read does, but return
+ * 1 if its tag was in the cache and 0 on a miss instead of the data.
+ */
+int cache_lookup(cache_t *cache, uintptr_t address, func_t generate_random_number);
+
+/*
+ * Replay count addresses through the cache, as cache_lookup would, in a
+ * single call. If hits is not NULL, hits[i] is set to 1 if the i'th
+ * access hit and 0 otherwise. If set_hits or set_misses is not NULL, it
+ * must have num_sets entries, and the hits or misses of each set are
+ * added to them. A NULL generate_random_number uses rand(). Returns the
+ * number of hits.
+ *
+ * This is the entry point for driving the cache from other languages:
+ * from Python, NumPy arrays can be passed through ctypes without a copy,
+ * and ctypes releases the GIL for the duration of the call (see
+ * readcache.py).
+ */
+size_t cache_replay(cache_t *cache, const uint64_t *addresses, size_t count, uint8_t *hits,
+                    uint64_t *set_hits, uint64_t *set_misses, func_t generate_random_number);
+
+/*
+ * Replay count addresses through the cache under Belady's optimal (OPT)
+ * replacement, which evicts the line whose block is next used furthest
+ * in the future, whatever the cache's own policy. This bounds the miss
+ * rate any policy can reach on the trace. hits is filled in as by
+ * cache_replay if it is not NULL; the counters are updated as usual.
+ *
+ * Next uses are computed in one backward pass with a hash table of the
+ * distinct blocks, so memory grows with the trace footprint, not its
+ * length: longer traces are processed a chunk at a time, with the next
+ * uses spilled to a temporary file. Traces larger than memory can be
+ * mapped from a file of 64-bit addresses (TRACE_FORMAT_BINARY). Returns
+ * 0, or -1 if the temporary file could not be written or read.
+ */
+int cache_opt_replay(cache_t *cache, const uint64_t *addresses, size_t count, uint8_t *hits);
+
+/*
+ * Replay count addresses like cache_replay, but set by set: each chunk
+ * of the trace is stably partitioned by set index, then the accesses to
+ * each set are replayed together while its metadata is in the host's
+ * caches. Sets evolve independently, so every access gets the same
+ * result as under cache_replay; hits, set_hits and set_misses are filled
+ * in the same way, in trace order. Scratch memory is bounded by the
+ * chunk size, so traces larger than memory can be mapped from a file of
+ * 64-bit addresses (TRACE_FORMAT_BINARY).
+ *
+ * Returns 0, or -1 if the cache keeps state shared across sets whose
+ * evolution depends on the order of accesses: the adaptive replacement
+ * or DIP insertion policies, bypass prediction, a non-blocking timing
+ * model, or an observer. Random replacement and BIP insertion need
+ * per-set random number streams (cache_set_random_streams).
+ */
+int cache_replay_by_set(cache_t *cache, const uint64_t *addresses, size_t count, uint8_t *hits,
+                        uint64_t *set_hits, uint64_t *set_misses);
+
+/*
+ * Return the block number of an address: the address divided by the
+ * line size. Caches with the same line size agree on it.
+ */
+uint64_t cache_block_number(cache_t *cache, uintptr_t address);
+
+/*
+ * Read a single long integer from the cache when the block number of the
+ * address is already known, so that callers feeding one address to
+ * several caches with the same line size only divide once.
+ */
+long cache_read_block(cache_t *cache, uintptr_t address, uint64_t block,
+                      func_t generate_random_number);
+
+/*
+ * Write a single long integer to memory and/or the cache. Only the low
+ * 32 bits are stored, matching what cache_read returns.
  */
 void cache_write(cache_t *cache, uintptr_t address, long value, func_t generate_random_number);
 
 /*
  * Return the number of cache misses since the cache was created.
  */
-int cache_miss_count(cache_t *cache);
+uint64_t cache_miss_count(cache_t *cache);
 
 /*
  * Return the number of cache accesses since the cache was created.
  */
-int cache_access_count(cache_t *cache);
+uint64_t cache_access_count(cache_t *cache);
+
+/*
+ * Return the number of accesses whose tag matched but whose sector had
+ * not been fetched yet. These are not included in cache_miss_count.
+ */
+uint64_t cache_sector_miss_count(cache_t *cache);
+
+/*
+ * Return the number of bytes fetched from memory since the cache was created.
+ */
+uint64_t cache_bytes_fetched(cache_t *cache);
+
+/*
+ * Return the number of bytes written to memory since the cache was
+ * created, by write-through stores and write-back evictions.
+ */
+uint64_t cache_bytes_written(cache_t *cache);
+
+/*
+ * Set the timing model used for the cycle estimate. Cycles already
+ * accumulated are kept; only later accesses use the new parameters.
+ */
+void cache_set_timing(cache_t *cache, const cache_timing_t *timing);
+
+/*
+ * Return the estimated number of cycles spent in the cache since it
+ * was created, according to its timing model. In non-blocking mode this
+ * is the time at which the last access was issued or the last fill
+ * completed, whichever is later.
+ */
+uint64_t cache_cycle_estimate(cache_t *cache);
+
+/*
+ * Return the average memory access time in cycles, or 0 if the cache
+ * has not been accessed yet.
+ */
+double cache_amat(cache_t *cache);
+
+/*
+ * Non-blocking mode: return the number of misses to a sector whose fill
+ * was already in flight, and which were merged into that fill.
+ */
+int cache_coalesced_count(cache_t *cache);
+
+/*
+ * Non-blocking mode: return the number of times a miss found every MSHR
+ * busy and the cache had to stall.
+ */
+int cache_mshr_stall_count(cache_t *cache);
+
+/*
+ * Non-blocking mode: return the memory-level parallelism, the average
+ * number of fills in flight over the cycles with at least one in flight.
+ */
+double cache_mlp(cache_t *cache);
+
+/*
+ * Bypass prediction: return the number of misses that bypassed the
+ * cache, and the share of them whose block was not needed again while
+ * it would have been cached (1 if there were none).
+ */
+unsigned int cache_bypass_count(cache_t *cache);
+double cache_bypass_accuracy(cache_t *cache);
+
+/*
+ * Restrict a class of service to the ways set in way_mask, and turn way
+ * partitioning on if it was off; classes not given a mask may use every
+ * way. Masks need not be contiguous, and those of different classes may
+ * overlap. Statistics are kept from then on. Partitions are not saved in
+ * snapshots. Returns -1 if the class id is out of range, the mask is
+ * empty or names ways the cache does not have, or the cache has more
+ * than 64 ways.
+ */
+int cache_set_class_ways(cache_t *cache, unsigned int class_id, uint64_t way_mask);
+
+/*
+ * Fill in the statistics of a class of service, all 0 if way
+ * partitioning is off.
+ */
+void cache_class_stats(cache_t *cache, unsigned int class_id, cache_class_stats_t *stats);
+
+/*
+ * Call observer with the given context and the block number of every
+ * access from then on, or stop if observer is NULL. Observers are not
+ * saved in snapshots nor inherited by forks.
+ */
+void cache_set_observer(cache_t *cache, cache_observer_t observer, void *context);
+
+/*
+ * Give every set its own stream of random numbers, seeded from seed, to
+ * draw from instead of the function passed to each access, for random
+ * replacement and BIP insertion. Results then no longer depend on how
+ * accesses to different sets interleave. Streams are not saved in
+ * snapshots.
+ */
+void cache_set_random_streams(cache_t *cache, uint64_t seed);
+
+/*
+ * Adaptive policy: return the replacement policy the follower sets
+ * currently use, CACHE_REPLACEMENTPOLICY_LRU or _MRU.
+ */
+int cache_duel_winner(cache_t *cache);
+
+/*
+ * DIP: return the insertion policy the follower sets currently use,
+ * CACHE_INSERTIONPOLICY_MRU or _BIP.
+ */
+int cache_dip_winner(cache_t *cache);
+
+/*
+ * Set the number of fills per MRU insertion under BIP and DIP (0 is
+ * taken as 1, which inserts every line at MRU).
+ */
+void cache_set_bip_throttle(cache_t *cache, unsigned int throttle);
+
+/*
+ * Print the cache statistics and the timing estimate to the given stream.
+ */
+void cache_report(cache_t *cache, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
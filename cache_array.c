@@ -0,0 +1,112 @@
+#include "cache_array.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Create an array over the given caches, grouping them by line size.
+ */
+cache_array_t *cache_array_new(cache_t **caches, unsigned int num_caches, int threaded) {
+    cache_array_t *array = (cache_array_t *)malloc(sizeof(cache_array_t));
+    array->groups = (cache_array_group_t *)calloc(num_caches, sizeof(cache_array_group_t));
+    array->num_groups = 0;
+    array->threaded = threaded;
+
+    for (unsigned int i = 0; i < num_caches; i++) {
+        cache_array_group_t *group = NULL;
+        for (unsigned int g = 0; g < array->num_groups; g++) {
+            if (array->groups[g].caches[0]->line_size == caches[i]->line_size) {
+                group = &array->groups[g];
+                break;
+            }
+        }
+        if (group == NULL) {
+            group = &array->groups[array->num_groups++];
+            group->caches = (cache_t **)malloc(num_caches * sizeof(cache_t *));
+            group->blocks = (uint64_t *)malloc(CACHE_ARRAY_BATCH * sizeof(uint64_t));
+            group->array = array;
+        }
+        group->caches[group->num_caches++] = caches[i];
+    }
+
+    return array;
+}
+
+/*
+ * Frees the array, but not its caches.
+ */
+void cache_array_free(cache_array_t *array) {
+    for (unsigned int g = 0; g < array->num_groups; g++) {
+        free(array->groups[g].caches);
+        free(array->groups[g].blocks);
+    }
+    free(array->groups);
+    free(array);
+}
+
+/*
+ * Replay the addresses of the array through one group of caches, a
+ * batch at a time: decode the batch once, then run it through each
+ * cache in turn.
+ */
+static void cache_array_group_read(cache_array_group_t *group) {
+    cache_array_t *array = group->array;
+    cache_t *first = group->caches[0];
+
+    for (size_t start = 0; start < array->count; start += CACHE_ARRAY_BATCH) {
+        const uintptr_t *addresses = array->addresses + start;
+        size_t n = array->count - start;
+        if (n > CACHE_ARRAY_BATCH) {
+            n = CACHE_ARRAY_BATCH;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            group->blocks[i] = cache_block_number(first, addresses[i]);
+        }
+        for (unsigned int c = 0; c < group->num_caches; c++) {
+            cache_t *cache = group->caches[c];
+            for (size_t i = 0; i < n; i++) {
+                cache_read_block(cache, addresses[i], group->blocks[i], array->generate_random_number);
+            }
+        }
+    }
+}
+
+/*
+ * Thread entry point: replay the addresses through one group.
+ */
+static void *cache_array_group_thread(void *group) {
+    cache_array_group_read(group);
+    return NULL;
+}
+
+/*
+ * Read every address from every cache of the array.
+ */
+void cache_array_read(cache_array_t *array, const uintptr_t *addresses, size_t count,
+                      func_t generate_random_number) {
+    array->addresses = addresses;
+    array->count = count;
+    array->generate_random_number = generate_random_number;
+
+    if (!array->threaded || array->num_groups < 2) {
+        for (unsigned int g = 0; g < array->num_groups; g++) {
+            cache_array_group_read(&array->groups[g]);
+        }
+        return;
+    }
+
+    // One thread per group.
+    for (unsigned int g = 0; g < array->num_groups; g++) {
+        cache_array_group_t *group = &array->groups[g];
+        if (pthread_create(&group->thread, NULL, cache_array_group_thread, group) != 0) {
+            // Fall back to replaying this group on the calling thread.
+            group->thread = pthread_self();
+            cache_array_group_read(group);
+        }
+    }
+    for (unsigned int g = 0; g < array->num_groups; g++) {
+        if (!pthread_equal(array->groups[g].thread, pthread_self())) {
+            pthread_join(array->groups[g].thread, NULL);
+        }
+    }
+}
@@ -0,0 +1,86 @@
+/*
+ * cache_array.h
+ *
+ * Driver that feeds one address stream to many caches in a single pass,
+ * for sweeping cache geometries and policies over the same trace.
+ */
+#ifndef CACHE_ARRAY_H
+#define CACHE_ARRAY_H
+
+#include <pthread.h>
+#include "cache.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Number of addresses decoded and replayed at a time. Every cache of a
+ * group replays the whole batch before the next cache starts, so its
+ * sets stay in the host's caches for the length of the batch.
+ */
+#define CACHE_ARRAY_BATCH 4096
+
+/*
+ * Structure used to store a group of caches sharing a line size: the
+ * block number of each address is computed once for all of them.
+ */
+typedef struct cache_array_group_s {
+    /* The caches in the group. */
+    cache_t **caches;
+    unsigned int num_caches;
+
+    /* Block numbers of the batch being replayed. */
+    uint64_t *blocks;
+
+    /* The array the group belongs to. */
+    struct cache_array_s *array;
+
+    /* Worker thread, when the array is threaded. */
+    pthread_t thread;
+} cache_array_group_t;
+
+/*
+ * Structure used to store a cache array.
+ */
+typedef struct cache_array_s {
+    /* Groups of caches, one per distinct line size. */
+    cache_array_group_t *groups;
+    unsigned int num_groups;
+
+    /* Whether each group is replayed by its own thread. */
+    int threaded;
+
+    /* The addresses being replayed, and the random number generator. */
+    const uintptr_t *addresses;
+    size_t count;
+    func_t generate_random_number;
+} cache_array_t;
+
+/*
+ * Create an array over the given caches, which remain owned by the
+ * caller. If threaded is non-zero, each group of caches with the same
+ * line size is replayed by its own thread; the random number generator
+ * must then be thread safe, and random replacement is no longer
+ * reproducible from run to run.
+ */
+cache_array_t *cache_array_new(cache_t **caches, unsigned int num_caches, int threaded);
+
+/*
+ * Frees the array, but not its caches.
+ */
+void cache_array_free(cache_array_t *array);
+
+/*
+ * Read every address from every cache of the array. Each cache sees the
+ * addresses in order, exactly as if cache_read had been called on it
+ * for each of them.
+ */
+void cache_array_read(cache_array_t *array, const uintptr_t *addresses, size_t count,
+                      func_t generate_random_number);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
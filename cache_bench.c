@@ -0,0 +1,386 @@
+/*
+ * cache_bench.c
+ *
+ * Benchmarks for the cache: hit and miss latency of cache_read, the cost
+ * of keeping recency lists as associativity grows, and end-to-end replay
+ * throughput on synthetic address streams, for each replacement policy
+ * and several geometries. Build and run with:
+ *
+ *     cc -O2 -o cache_bench cache_bench.c cache.c workload.c -lm
+ *     ./cache_bench --benchmark_format=json > bench.json
+ *
+ * The options and the JSON layout follow Google Benchmark, so results
+ * can be compared with its tools:
+ *
+ *     --benchmark_filter=<substring>   only run matching benchmarks
+ *     --benchmark_min_time=<seconds>   minimum time per benchmark
+ *     --benchmark_format=<console|json>
+ */
+#define _POSIX_C_SOURCE 200809L
+#include "cache.h"
+#include "workload.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Number of addresses in each synthetic stream.
+ */
+#define BENCH_STREAM_LENGTH (1 << 20)
+
+/*
+ * Size of the buffer miss benchmarks stream through, well beyond any of
+ * the geometries below.
+ */
+#define BENCH_BUFFER_BYTES (64 << 20)
+
+/*
+ * A cache geometry to benchmark.
+ */
+typedef struct bench_geometry_s {
+    const char *name;
+    size_t num_bytes, line_size;
+    unsigned int associativity;
+} bench_geometry_t;
+
+static const bench_geometry_t bench_geometries[] = {
+    { "32K_64B_8w",    32 << 10,   64,  8 },
+    { "48K_64B_12w",   48 << 10,   64, 12 },
+    { "1M_64B_16w",     1 << 20,   64, 16 },
+    { "1280K_64B_20w", 1280 << 10, 64, 20 },
+};
+
+/*
+ * A replacement policy to benchmark.
+ */
+typedef struct bench_policy_s {
+    const char *name;
+    int policy;
+} bench_policy_t;
+
+static const bench_policy_t bench_policies[] = {
+    { "random",   CACHE_REPLACEMENTPOLICY_RANDOM },
+    { "lru",      CACHE_REPLACEMENTPOLICY_LRU },
+    { "mru",      CACHE_REPLACEMENTPOLICY_MRU },
+    { "adaptive", CACHE_REPLACEMENTPOLICY_ADAPTIVE },
+    { "lru_dip",  CACHE_REPLACEMENTPOLICY_LRU | CACHE_INSERTIONPOLICY_DIP },
+};
+
+#define BENCH_COUNT(array) (sizeof(array) / sizeof((array)[0]))
+
+/*
+ * Options and output state.
+ */
+static const char *bench_filter = "";
+static double bench_min_time = 0.2;
+static int bench_json = 0;
+static int bench_first = 1;
+
+/*
+ * Deterministic random numbers, so every run replays the same streams.
+ */
+static uint64_t bench_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t bench_next(void) {
+    bench_state ^= bench_state << 13;
+    bench_state ^= bench_state >> 7;
+    bench_state ^= bench_state << 17;
+    return bench_state;
+}
+
+static int bench_random(void) {
+    return bench_next() & 0x7fffffff;
+}
+
+/*
+ * Return the current time, or the CPU time used by the process, in
+ * seconds.
+ */
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double bench_cpu_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * A benchmark body: run the given number of operations.
+ */
+typedef void (*bench_body_t)(void *context, size_t operations);
+
+/*
+ * Run a benchmark, doubling the number of operations until a run takes
+ * at least the minimum time, and report the last run.
+ */
+static void bench_run(const char *name, bench_body_t body, void *context) {
+    if (strstr(name, bench_filter) == NULL) {
+        return;
+    }
+
+    size_t operations = 1024;
+    double elapsed, cpu;
+    for (;;) {
+        double start = bench_now(), cpu_start = bench_cpu_now();
+        body(context, operations);
+        elapsed = bench_now() - start;
+        cpu = bench_cpu_now() - cpu_start;
+        if (elapsed >= bench_min_time || operations >= ((size_t)1 << 40)) {
+            break;
+        }
+        operations *= elapsed > 0.01 ? (size_t)(bench_min_time / elapsed * 1.2) + 1 : 8;
+    }
+
+    double ns = elapsed * 1e9 / operations;
+    double cpu_ns = cpu * 1e9 / operations;
+    double rate = operations / elapsed;
+    if (bench_json) {
+        printf("%s\n    {\n", bench_first ? "" : ",");
+        printf("      \"name\": \"%s\",\n", name);
+        printf("      \"run_name\": \"%s\",\n", name);
+        printf("      \"run_type\": \"iteration\",\n");
+        printf("      \"iterations\": %zu,\n", operations);
+        printf("      \"real_time\": %.4f,\n", ns);
+        printf("      \"cpu_time\": %.4f,\n", cpu_ns);
+        printf("      \"time_unit\": \"ns\",\n");
+        printf("      \"items_per_second\": %.2f\n", rate);
+        printf("    }");
+    } else {
+        printf("%-48s %12.2f ns %16.0f items/s\n", name, ns, rate);
+    }
+    bench_first = 0;
+    fflush(stdout);
+}
+
+/*
+ * Context shared by the benchmarks: the cache under test, the address
+ * stream it reads, and where in the stream it is.
+ */
+typedef struct bench_context_s {
+    cache_t *cache;
+    const uint64_t *addresses;
+    size_t count, next;
+} bench_context_t;
+
+/*
+ * Read the stream from the cache one cache_read at a time, wrapping
+ * around at its end.
+ */
+static void bench_read_stream(void *arg, size_t operations) {
+    bench_context_t *context = arg;
+    volatile long sink;
+
+    for (size_t i = 0; i < operations; i++) {
+        sink = cache_read(context->cache, context->addresses[context->next], bench_random);
+        if (++context->next == context->count) {
+            context->next = 0;
+        }
+    }
+    (void)sink;
+}
+
+/*
+ * Replay the given number of addresses with cache_replay, in calls of
+ * at most a whole stream, each from the start of the stream.
+ */
+static void bench_replay_stream(void *arg, size_t operations) {
+    bench_context_t *context = arg;
+
+    while (operations > 0) {
+        size_t n = operations < context->count ? operations : context->count;
+        cache_replay(context->cache, context->addresses, n, NULL, NULL, NULL, bench_random);
+        operations -= n;
+    }
+}
+
+/*
+ * Hit latency: read a working set of half the capacity, warmed first, so
+ * every read is a hit.
+ */
+static void bench_hits(void) {
+    size_t count = 1 << 16;
+    uint64_t *addresses = malloc(count * sizeof(uint64_t));
+    uint8_t *buffer = calloc(1, 2 << 20);
+    char name[128];
+
+    for (size_t g = 0; g < BENCH_COUNT(bench_geometries); g++) {
+        const bench_geometry_t *geometry = &bench_geometries[g];
+        size_t lines = geometry->num_bytes / geometry->line_size / 2;
+        for (size_t i = 0; i < count; i++) {
+            addresses[i] = (uintptr_t)buffer + (bench_next() % lines) * geometry->line_size;
+        }
+
+        for (size_t p = 0; p < BENCH_COUNT(bench_policies); p++) {
+            cache_t *cache = cache_new(geometry->num_bytes, geometry->line_size,
+                                       geometry->associativity, bench_policies[p].policy);
+            bench_context_t context = { cache, addresses, count, 0 };
+            for (size_t i = 0; i < lines; i++) {
+                cache_read(cache, (uintptr_t)buffer + i * geometry->line_size, bench_random);
+            }
+            snprintf(name, sizeof(name), "BM_Hit/%s/%s", bench_policies[p].name, geometry->name);
+            bench_run(name, bench_read_stream, &context);
+            cache_free(cache);
+        }
+    }
+
+    free(buffer);
+    free(addresses);
+}
+
+/*
+ * Miss latency: stream through a buffer far larger than the cache a line
+ * at a time, so every read misses and copies a line in.
+ */
+static void bench_misses(void) {
+    size_t line_size = bench_geometries[0].line_size;
+    size_t count = BENCH_BUFFER_BYTES / line_size;
+    uint64_t *addresses = malloc(count * sizeof(uint64_t));
+    uint8_t *buffer = malloc(BENCH_BUFFER_BYTES);
+    char name[128];
+
+    memset(buffer, 1, BENCH_BUFFER_BYTES);
+    for (size_t i = 0; i < count; i++) {
+        addresses[i] = (uintptr_t)buffer + i * line_size;
+    }
+
+    for (size_t g = 0; g < BENCH_COUNT(bench_geometries); g++) {
+        const bench_geometry_t *geometry = &bench_geometries[g];
+        for (size_t p = 0; p < BENCH_COUNT(bench_policies); p++) {
+            cache_t *cache = cache_new(geometry->num_bytes, geometry->line_size,
+                                       geometry->associativity, bench_policies[p].policy);
+            bench_context_t context = { cache, addresses, count, 0 };
+            snprintf(name, sizeof(name), "BM_Miss/%s/%s", bench_policies[p].name, geometry->name);
+            bench_run(name, bench_read_stream, &context);
+            cache_free(cache);
+        }
+    }
+
+    free(buffer);
+    free(addresses);
+}
+
+/*
+ * Recency list cost: a single LRU set read round-robin, so every read
+ * hits the least recently used line and moves it across the whole list.
+ */
+static void bench_make_mru(void) {
+    static const unsigned int ways[] = { 1, 2, 4, 8, 12, 16, 20, 32, 64 };
+    uint64_t addresses[64];
+    char name[128];
+
+    for (size_t w = 0; w < BENCH_COUNT(ways); w++) {
+        cache_t *cache = cache_new(ways[w] * 64, 64, ways[w],
+                                   CACHE_REPLACEMENTPOLICY_LRU | CACHE_DATAPOLICY_NODATA);
+        for (unsigned int i = 0; i < ways[w]; i++) {
+            addresses[i] = i * 64;
+            cache_read(cache, addresses[i], bench_random);
+        }
+        bench_context_t context = { cache, addresses, ways[w], 0 };
+        snprintf(name, sizeof(name), "BM_MakeMRU/%u", ways[w]);
+        bench_run(name, bench_read_stream, &context);
+        cache_free(cache);
+    }
+}
+
+/*
+ * A named address stream to replay.
+ */
+typedef struct bench_stream_s {
+    const char *name;
+    workload_config_t config;
+} bench_stream_t;
+
+/*
+ * Streams within a 64MB range: sequential and strided scans, uniform
+ * random and Zipf distributed lines, a shuffled linked list, and a
+ * 512x512 matrix multiply in 32x32 tiles.
+ */
+static const bench_stream_t bench_streams[] = {
+    { "sequential",    { .kind = WORKLOAD_SEQUENTIAL, .seed = 1, .footprint = BENCH_BUFFER_BYTES,
+                         .element_size = 8 } },
+    { "strided",       { .kind = WORKLOAD_STRIDED, .seed = 1, .footprint = BENCH_BUFFER_BYTES,
+                         .element_size = 8, .stride = 4160 } },
+    { "random",        { .kind = WORKLOAD_UNIFORM, .seed = 1, .footprint = BENCH_BUFFER_BYTES,
+                         .element_size = 64 } },
+    { "zipf",          { .kind = WORKLOAD_ZIPF, .seed = 1, .footprint = BENCH_BUFFER_BYTES,
+                         .element_size = 64, .zipf_exponent = 0.99 } },
+    { "pointer_chase", { .kind = WORKLOAD_POINTER_CHASE, .seed = 1, .footprint = BENCH_BUFFER_BYTES,
+                         .element_size = 64 } },
+    { "matrix",        { .kind = WORKLOAD_MATRIX, .seed = 1, .element_size = 8,
+                         .matrix_size = 512, .tile_size = 32 } },
+};
+
+/*
+ * Replay throughput: whole streams through tag-only caches with
+ * cache_replay.
+ */
+static void bench_replays(void) {
+    uint64_t *addresses = malloc(BENCH_STREAM_LENGTH * sizeof(uint64_t));
+    char name[128];
+
+    for (size_t s = 0; s < BENCH_COUNT(bench_streams); s++) {
+        workload_t *workload = workload_new(&bench_streams[s].config);
+        workload_fill(workload, addresses, BENCH_STREAM_LENGTH);
+        workload_free(workload);
+
+        for (size_t g = 0; g < BENCH_COUNT(bench_geometries); g++) {
+            const bench_geometry_t *geometry = &bench_geometries[g];
+            for (size_t p = 0; p < BENCH_COUNT(bench_policies); p++) {
+                cache_t *cache = cache_new(geometry->num_bytes, geometry->line_size, geometry->associativity,
+                                           bench_policies[p].policy | CACHE_DATAPOLICY_NODATA);
+                bench_context_t context = { cache, addresses, BENCH_STREAM_LENGTH, 0 };
+                snprintf(name, sizeof(name), "BM_Replay/%s/%s/%s",
+                         bench_streams[s].name, bench_policies[p].name, geometry->name);
+                bench_run(name, bench_replay_stream, &context);
+                cache_free(cache);
+            }
+        }
+    }
+
+    free(addresses);
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--benchmark_filter=", 19) == 0) {
+            bench_filter = argv[i] + 19;
+        } else if (strncmp(argv[i], "--benchmark_min_time=", 21) == 0) {
+            bench_min_time = atof(argv[i] + 21);
+        } else if (strcmp(argv[i], "--benchmark_format=json") == 0) {
+            bench_json = 1;
+        } else if (strcmp(argv[i], "--benchmark_format=console") == 0) {
+            bench_json = 0;
+        } else {
+            fprintf(stderr, "usage: %s [--benchmark_filter=<substring>] [--benchmark_min_time=<seconds>]"
+                    " [--benchmark_format=<console|json>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (bench_json) {
+        char date[64];
+        time_t now = time(NULL);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+        printf("{\n  \"context\": {\n");
+        printf("    \"date\": \"%s\",\n", date);
+        printf("    \"executable\": \"%s\",\n", argv[0]);
+        printf("    \"num_cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+        printf("    \"library_build_type\": \"release\"\n");
+        printf("  },\n  \"benchmarks\": [");
+    }
+
+    bench_hits();
+    bench_misses();
+    bench_make_mru();
+    bench_replays();
+
+    if (bench_json) {
+        printf("\n  ]\n}\n");
+    }
+    return 0;
+}
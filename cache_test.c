@@ -0,0 +1,564 @@
+/*
+ * cache_test.c
+ *
+ * Smoke and regression tests for the cache: non-power-of-two geometries
+ * against a reference LRU model, sectored data, snapshot round trips and
+ * forks, OPT against a reference Belady model, and set-bucketed replay
+ * against cache_replay. Build and run with:
+ *
+ *     cc -O2 -o cache_test cache_test.c cache.c -lm
+ *     ./cache_test
+ *
+ * Prints every failed check and exits with status 1 if there was any.
+ */
+#include "cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Number of addresses in each test trace.
+ */
+#define TEST_TRACE_LENGTH 50000
+
+/*
+ * Number of failed checks so far.
+ */
+static int test_failures = 0;
+
+#define TEST_CHECK(condition, ...)                                  \
+    do {                                                            \
+        if (!(condition)) {                                         \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);         \
+            fprintf(stderr, __VA_ARGS__);                           \
+            fprintf(stderr, "\n");                                  \
+            test_failures++;                                        \
+        }                                                           \
+    } while (0)
+
+/*
+ * Deterministic random numbers, so every run checks the same traces.
+ */
+static uint64_t test_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t test_next(void) {
+    test_state ^= test_state << 13;
+    test_state ^= test_state >> 7;
+    test_state ^= test_state << 17;
+    return test_state;
+}
+
+static int test_random(void) {
+    return test_next() & 0x7fffffff;
+}
+
+/*
+ * Fill a trace with addresses of blocks of the given size, drawn from
+ * num_blocks blocks starting at base, half of them from the first eighth
+ * so that some lines are reused while they are cached.
+ */
+static void test_trace(uint64_t *addresses, size_t count, uintptr_t base, size_t block_size,
+                       size_t num_blocks) {
+    for (size_t i = 0; i < count; i++) {
+        uint64_t r = test_next();
+        size_t block = (r & 1) ? (r >> 1) % num_blocks : (r >> 1) % (num_blocks / 8 + 1);
+        addresses[i] = base + block * block_size + (r >> 40) % block_size / 4 * 4;
+    }
+}
+
+/*
+ * Reference model of a set-associative cache: for each line, its block
+ * and the time of its last use, or of its next use for OPT.
+ */
+typedef struct test_model_s {
+    unsigned int num_sets, associativity;
+    uint64_t *blocks, *times;
+    uint8_t *valid;
+} test_model_t;
+
+static void test_model_init(test_model_t *model, unsigned int num_sets, unsigned int associativity) {
+    model->num_sets = num_sets;
+    model->associativity = associativity;
+    model->blocks = calloc((size_t)num_sets * associativity, sizeof(uint64_t));
+    model->times = calloc((size_t)num_sets * associativity, sizeof(uint64_t));
+    model->valid = calloc((size_t)num_sets * associativity, 1);
+}
+
+static void test_model_free(test_model_t *model) {
+    free(model->blocks);
+    free(model->times);
+    free(model->valid);
+}
+
+/*
+ * Access a block in the model at the given time, stamping the line with
+ * stamp. On a miss into a full set, the line with the lowest stamp is
+ * evicted if lowest is set and the highest otherwise. Returns whether
+ * the block was found.
+ */
+static int test_model_access(test_model_t *model, uint64_t block, uint64_t stamp, int lowest) {
+    size_t first = (size_t)(block % model->num_sets) * model->associativity;
+    size_t victim = SIZE_MAX;
+
+    for (size_t i = first; i < first + model->associativity; i++) {
+        if (model->valid[i] && model->blocks[i] == block) {
+            model->times[i] = stamp;
+            return 1;
+        }
+        if (!model->valid[i]) {
+            if (victim == SIZE_MAX || model->valid[victim]) {
+                victim = i;
+            }
+        } else if (victim == SIZE_MAX
+                   || (model->valid[victim]
+                       && (lowest ? model->times[i] < model->times[victim] : model->times[i] > model->times[victim]))) {
+            victim = i;
+        }
+    }
+    model->valid[victim] = 1;
+    model->blocks[victim] = block;
+    model->times[victim] = stamp;
+    return 0;
+}
+
+/*
+ * Non-power-of-two geometries: odd set counts, associativities and line
+ * sizes hit and miss exactly as a reference LRU cache, and return the
+ * data at every address.
+ */
+static void test_geometries(void) {
+    static const struct { size_t num_bytes, line_size; unsigned int associativity; } geometries[] = {
+        { 48 << 10,   64, 12 },
+        { 100 * 3 * 48, 48, 3 },
+        { 7 * 5 * 40, 40, 5 },
+        { 1000 * 64,  64, 1 },
+        { 20 * 96,    96, 20 },
+    };
+    uint64_t *addresses = malloc(TEST_TRACE_LENGTH * sizeof(uint64_t));
+    uint8_t *hits = malloc(TEST_TRACE_LENGTH);
+    size_t buffer_bytes = 1 << 20;
+    uint32_t *buffer = malloc(buffer_bytes);
+
+    for (size_t i = 0; i < buffer_bytes / 4; i++) {
+        buffer[i] = (uint32_t)(i * 2654435761u);
+    }
+
+    for (size_t g = 0; g < sizeof(geometries) / sizeof(geometries[0]); g++) {
+        size_t line_size = geometries[g].line_size;
+        cache_t *cache = cache_new(geometries[g].num_bytes, line_size, geometries[g].associativity,
+                                   CACHE_REPLACEMENTPOLICY_LRU | CACHE_DATAPOLICY_NODATA);
+        TEST_CHECK(cache != NULL, "geometry %zu rejected", g);
+        if (cache == NULL) {
+            continue;
+        }
+
+        test_model_t model;
+        test_model_init(&model, cache->num_sets, geometries[g].associativity);
+        test_trace(addresses, TEST_TRACE_LENGTH, 0, line_size, cache->num_lines * 3);
+        cache_replay(cache, addresses, TEST_TRACE_LENGTH, hits, NULL, NULL, test_random);
+        size_t mismatches = 0;
+        for (size_t i = 0; i < TEST_TRACE_LENGTH; i++) {
+            mismatches += hits[i] != test_model_access(&model, addresses[i] / line_size, i, 1);
+        }
+        TEST_CHECK(mismatches == 0, "geometry %zu: %zu accesses differ from the LRU model", g, mismatches);
+        test_model_free(&model);
+        cache_free(cache);
+
+        // The same geometry keeping data returns what is in memory.
+        cache = cache_new(geometries[g].num_bytes, line_size, geometries[g].associativity,
+                          CACHE_REPLACEMENTPOLICY_LRU);
+        // Lines are filled from line-aligned addresses, so only use the
+        // lines wholly inside the buffer.
+        uintptr_t base = ((uintptr_t)buffer + line_size - 1) / line_size * line_size;
+        test_trace(addresses, TEST_TRACE_LENGTH, base, line_size, (buffer_bytes - line_size) / line_size);
+        mismatches = 0;
+        for (size_t i = 0; i < TEST_TRACE_LENGTH; i++) {
+            mismatches += (uint32_t)cache_read(cache, addresses[i], test_random) != *(uint32_t *)addresses[i];
+        }
+        TEST_CHECK(mismatches == 0, "geometry %zu: %zu reads return wrong data", g, mismatches);
+        cache_free(cache);
+    }
+
+    TEST_CHECK(cache_new(0, 64, 4, 0) == NULL, "zero size accepted");
+    TEST_CHECK(cache_new(1000, 64, 4, 0) == NULL, "partial line accepted");
+    TEST_CHECK(cache_new(64 * 6, 64, 4, 0) == NULL, "partial set accepted");
+    TEST_CHECK(cache_new(64, 2, 32, 0) == NULL, "line shorter than a word accepted");
+
+    free(buffer);
+    free(hits);
+    free(addresses);
+}
+
+/*
+ * Sectored caches: the same tags hit as without sectors, reads and
+ * writes see the data written, and only the sectors touched are fetched.
+ */
+static void test_sectors(void) {
+    size_t buffer_bytes = 1 << 20;
+    uint32_t *buffer = aligned_alloc(4096, buffer_bytes), *shadow = malloc(buffer_bytes);
+    uint64_t *addresses = malloc(TEST_TRACE_LENGTH * sizeof(uint64_t));
+
+    for (size_t i = 0; i < buffer_bytes / 4; i++) {
+        buffer[i] = shadow[i] = (uint32_t)i;
+    }
+    test_trace(addresses, TEST_TRACE_LENGTH, (uintptr_t)buffer, 64, buffer_bytes / 64);
+
+    cache_t *plain = cache_new(16 << 10, 64, 4, CACHE_REPLACEMENTPOLICY_LRU | CACHE_WRITEPOLICY_WRITEBACK);
+    cache_t *sectored = cache_new_sectored(16 << 10, 64, 16, 4,
+                                           CACHE_REPLACEMENTPOLICY_LRU | CACHE_WRITEPOLICY_WRITEBACK);
+    TEST_CHECK(sectored != NULL, "sectored cache rejected");
+    if (sectored == NULL) {
+        cache_free(plain);
+        free(addresses);
+        free(shadow);
+        free(buffer);
+        return;
+    }
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < TEST_TRACE_LENGTH; i++) {
+        uintptr_t address = addresses[i];
+        size_t word = (address - (uintptr_t)buffer) / 4;
+        if (i % 4 == 0) {
+            cache_write(plain, address, (long)i, test_random);
+            cache_write(sectored, address, (long)i, test_random);
+            shadow[word] = (uint32_t)i;
+        } else {
+            mismatches += (uint32_t)cache_read(plain, address, test_random) != shadow[word];
+            mismatches += (uint32_t)cache_read(sectored, address, test_random) != shadow[word];
+        }
+    }
+    TEST_CHECK(mismatches == 0, "%zu reads return wrong data", mismatches);
+    TEST_CHECK(cache_miss_count(plain) == cache_miss_count(sectored),
+               "sectored cache misses %llu times, unsectored %llu",
+               (unsigned long long)cache_miss_count(sectored), (unsigned long long)cache_miss_count(plain));
+    TEST_CHECK(cache_bytes_fetched(sectored) < cache_bytes_fetched(plain),
+               "sectored cache fetched %llu bytes, unsectored %llu",
+               (unsigned long long)cache_bytes_fetched(sectored), (unsigned long long)cache_bytes_fetched(plain));
+    TEST_CHECK(cache_new_sectored(16 << 10, 64, 24, 4, 0) == NULL, "uneven sectors accepted");
+    TEST_CHECK(cache_new_sectored(16 << 10, 64, 2, 4, 0) == NULL, "sector shorter than a word accepted");
+
+    cache_free(sectored);
+    cache_free(plain);
+    free(addresses);
+    free(shadow);
+    free(buffer);
+}
+
+/*
+ * Save a cache to a temporary file and load it back, or return NULL.
+ */
+static cache_t *test_save_and_load(cache_t *cache, int flags) {
+    FILE *file = tmpfile();
+    cache_t *loaded = NULL;
+
+    if (cache_save(cache, fileno(file), flags) == 0) {
+        lseek(fileno(file), 0, SEEK_SET);
+        loaded = cache_load(fileno(file));
+    }
+    fclose(file);
+    return loaded;
+}
+
+/*
+ * Snapshots: a cache loaded from a snapshot, with or without data,
+ * continues exactly as the original does.
+ */
+static void test_snapshots(void) {
+    static const struct { size_t sector_size; int policies; } cases[] = {
+        { 64, CACHE_REPLACEMENTPOLICY_LRU },
+        { 16, CACHE_REPLACEMENTPOLICY_LRU | CACHE_WRITEPOLICY_WRITEBACK },
+        { 64, CACHE_REPLACEMENTPOLICY_ADAPTIVE | CACHE_DATAPOLICY_NODATA },
+        { 64, CACHE_REPLACEMENTPOLICY_LRU | CACHE_INSERTIONPOLICY_DIP | CACHE_DATAPOLICY_NODATA },
+        { 32, CACHE_REPLACEMENTPOLICY_MRU | CACHE_DATAPOLICY_NODATA },
+    };
+    size_t buffer_bytes = 1 << 20, half = TEST_TRACE_LENGTH / 2;
+    uint32_t *buffer = aligned_alloc(4096, buffer_bytes);
+    uint64_t *addresses = malloc(TEST_TRACE_LENGTH * sizeof(uint64_t));
+    uint8_t *hits = malloc(3 * half);
+
+    for (size_t i = 0; i < buffer_bytes / 4; i++) {
+        buffer[i] = (uint32_t)(i ^ 0x5a5a5a5a);
+    }
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        int data = (cases[c].policies & CACHE_DATAPOLICY_MASK) == CACHE_DATAPOLICY_DATA;
+        cache_t *cache = cache_new_sectored(32 << 10, 64, cases[c].sector_size, 8, cases[c].policies);
+        if (data) {
+            test_trace(addresses, TEST_TRACE_LENGTH, (uintptr_t)buffer, 64, buffer_bytes / 64);
+        } else {
+            // Tags spread far apart, so that some take the exact fallback.
+            for (size_t i = 0; i < TEST_TRACE_LENGTH; i++) {
+                uint64_t r = test_next();
+                addresses[i] = (r & 0xfffc0) | ((r >> 32) % 16) << 40;
+            }
+        }
+        for (size_t i = 0; i < half; i++) {
+            if (i % 5 == 0) {
+                cache_write(cache, addresses[i], (long)i, test_random);
+            } else {
+                cache_read(cache, addresses[i], test_random);
+            }
+        }
+
+        cache_t *with_data = test_save_and_load(cache, CACHE_SAVE_DATA);
+        cache_t *tags_only = test_save_and_load(cache, 0);
+        TEST_CHECK(with_data != NULL && tags_only != NULL, "case %zu: snapshot failed to load", c);
+        if (with_data == NULL || tags_only == NULL) {
+            continue;
+        }
+        TEST_CHECK(cache_miss_count(with_data) == cache_miss_count(cache)
+                   && cache_access_count(with_data) == cache_access_count(cache),
+                   "case %zu: counters differ after loading", c);
+        TEST_CHECK((tags_only->policies & CACHE_DATAPOLICY_MASK) == CACHE_DATAPOLICY_NODATA,
+                   "case %zu: snapshot without data restored as a data cache", c);
+        if (data) {
+            size_t mismatches = 0;
+            for (size_t i = 0; i < half; i++) {
+                mismatches += cache_read(with_data, addresses[i], test_random)
+                              != cache_read(cache, addresses[i], test_random);
+            }
+            TEST_CHECK(mismatches == 0, "case %zu: %zu reads differ after loading", c, mismatches);
+        }
+
+        // Every copy draws the same random numbers for the second half.
+        cache_t *copies[3] = { cache, with_data, tags_only };
+        uint64_t state = test_state;
+        for (int k = 0; k < 3; k++) {
+            test_state = state;
+            cache_replay(copies[k], addresses + half, half, hits + k * half, NULL, NULL, test_random);
+        }
+        TEST_CHECK(memcmp(hits, hits + half, half) == 0, "case %zu: snapshot with data diverges", c);
+        TEST_CHECK(memcmp(hits, hits + 2 * half, half) == 0, "case %zu: snapshot without data diverges", c);
+
+        cache_free(tags_only);
+        cache_free(with_data);
+        cache_free(cache);
+    }
+
+    // A truncated snapshot is rejected.
+    cache_t *cache = cache_new(8 << 10, 64, 4, CACHE_REPLACEMENTPOLICY_LRU | CACHE_DATAPOLICY_NODATA);
+    FILE *file = tmpfile();
+    cache_save(cache, fileno(file), 0);
+    off_t size = lseek(fileno(file), 0, SEEK_END);
+    TEST_CHECK(ftruncate(fileno(file), size / 2) == 0, "truncating the snapshot failed");
+    lseek(fileno(file), 0, SEEK_SET);
+    cache_t *loaded = cache_load(fileno(file));
+    TEST_CHECK(loaded == NULL, "truncated snapshot accepted");
+    if (loaded != NULL) {
+        cache_free(loaded);
+    }
+    fclose(file);
+    cache_free(cache);
+
+    free(hits);
+    free(addresses);
+    free(buffer);
+}
+
+/*
+ * Forks: copies forked without changes in between share one snapshot,
+ * see every change made before they were forked and none made after,
+ * and continue exactly as the original does, side state included.
+ */
+static void test_forks(void) {
+    static const struct { int policies; int classes; int streams; } cases[] = {
+        { CACHE_REPLACEMENTPOLICY_LRU, 0, 0 },
+        { CACHE_REPLACEMENTPOLICY_LRU | CACHE_BYPASSPOLICY, 0, 0 },
+        { CACHE_REPLACEMENTPOLICY_LRU, 1, 0 },
+        { CACHE_REPLACEMENTPOLICY_RANDOM | CACHE_INSERTIONPOLICY_BIP, 0, 1 },
+    };
+    size_t buffer_bytes = 1 << 20, half = TEST_TRACE_LENGTH / 2;
+    uint32_t *buffer = aligned_alloc(4096, buffer_bytes);
+    uint64_t *addresses = malloc(TEST_TRACE_LENGTH * sizeof(uint64_t));
+    uint8_t *hits = malloc(3 * half);
+
+    for (size_t i = 0; i < buffer_bytes / 4; i++) {
+        buffer[i] = (uint32_t)i;
+    }
+    test_trace(addresses, TEST_TRACE_LENGTH, (uintptr_t)buffer, 64, buffer_bytes / 64);
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        cache_t *cache = cache_new_sectored(32 << 10, 64, 16, 8, cases[c].policies | CACHE_WRITEPOLICY_WRITEBACK);
+        if (cases[c].classes) {
+            cache_set_class_ways(cache, 1, 0x0f);
+        }
+        if (cases[c].streams) {
+            cache_set_random_streams(cache, 7);
+        }
+        for (size_t i = 0; i < half; i++) {
+            cache_access_t access = { .address = addresses[i], .class_id = i % 2 };
+            cache_read_access(cache, &access, test_random);
+        }
+
+        cache_t *first = cache_fork(cache), *second = cache_fork(cache);
+        TEST_CHECK(first != NULL && second != NULL, "case %zu: fork failed", c);
+        if (first == NULL || second == NULL) {
+            continue;
+        }
+        TEST_CHECK(first->mapping != NULL && second->mapping != NULL, "case %zu: forks are not mapped", c);
+
+        // Each copy continues from the same state with the same random numbers.
+        cache_t *copies[3] = { cache, first, second };
+        uint64_t state = test_state;
+        for (int k = 0; k < 3; k++) {
+            test_state = state;
+            for (size_t i = 0; i < half; i++) {
+                cache_access_t access = { .address = addresses[half + i], .class_id = i % 2 };
+                uint64_t misses = cache_miss_count(copies[k]);
+                cache_read_access(copies[k], &access, test_random);
+                hits[k * half + i] = cache_miss_count(copies[k]) == misses;
+            }
+        }
+        TEST_CHECK(memcmp(hits, hits + half, half) == 0, "case %zu: first fork diverges", c);
+        TEST_CHECK(memcmp(hits, hits + 2 * half, half) == 0, "case %zu: second fork diverges", c);
+
+        cache_free(second);
+        cache_free(first);
+        cache_free(cache);
+    }
+
+    // Writes to a fork stay in it, and changes to the original after a
+    // fork only show in later forks, even those not counted as accesses.
+    cache_t *cache = cache_new(32 << 10, 64, 8, CACHE_REPLACEMENTPOLICY_LRU | CACHE_WRITEPOLICY_WRITEBACK);
+    for (size_t i = 0; i < 512; i++) {
+        cache_read(cache, (uintptr_t)buffer + i * 64, test_random);
+    }
+    cache_t *before = cache_fork(cache), *shared = cache_fork(cache);
+    TEST_CHECK(cache->fork_fd >= 0, "no snapshot kept for forks");
+    cache_write(before, (uintptr_t)buffer, 12345, test_random);
+    TEST_CHECK(cache_read(shared, (uintptr_t)buffer, test_random) == 0, "a write to one fork shows in another");
+    TEST_CHECK(cache_read(cache, (uintptr_t)buffer, test_random) == 0, "a write to a fork shows in the original");
+
+    cache_snoop(cache, (uintptr_t)buffer + 64, 1);
+    cache_line_set_state(cache_probe(cache, (uintptr_t)buffer + 128, 0), CACHE_LINE_SHARED);
+    cache_write(cache, (uintptr_t)buffer + 192, 777, test_random);
+    cache_t *after = cache_fork(cache);
+    TEST_CHECK(cache_probe(before, (uintptr_t)buffer + 64, 0) != NULL, "a snoop after a fork shows in it");
+    TEST_CHECK(cache_probe(after, (uintptr_t)buffer + 64, 0) == NULL, "a snoop before a fork is lost");
+    TEST_CHECK(cache_line_state(cache_probe(after, (uintptr_t)buffer + 128, 0)) == CACHE_LINE_SHARED,
+               "a state change before a fork is lost");
+    TEST_CHECK(cache_read(after, (uintptr_t)buffer + 192, test_random) == 777, "a write before a fork is lost");
+    TEST_CHECK(cache_read(before, (uintptr_t)buffer + 192, test_random) == 48, "a write after a fork shows in it");
+    cache_free(after);
+    cache_free(shared);
+    cache_free(before);
+    cache_free(cache);
+
+    free(hits);
+    free(addresses);
+    free(buffer);
+}
+
+/*
+ * OPT: cache_opt_replay hits exactly where a reference Belady cache
+ * does, and never less often than LRU.
+ */
+static void test_opt(void) {
+    uint64_t *addresses = malloc(TEST_TRACE_LENGTH * sizeof(uint64_t));
+    uint64_t *next = malloc(TEST_TRACE_LENGTH * sizeof(uint64_t));
+    uint8_t *hits = malloc(TEST_TRACE_LENGTH);
+    size_t num_blocks = 4096;
+    uint64_t *last = malloc(num_blocks * sizeof(uint64_t));
+
+    cache_t *cache = cache_new(48 * 64 * 6, 64, 6, CACHE_REPLACEMENTPOLICY_LRU | CACHE_DATAPOLICY_NODATA);
+    test_trace(addresses, TEST_TRACE_LENGTH, 0, 64, num_blocks);
+    for (size_t b = 0; b < num_blocks; b++) {
+        last[b] = UINT64_MAX;
+    }
+    for (size_t i = TEST_TRACE_LENGTH; i > 0; i--) {
+        uint64_t block = addresses[i - 1] / 64;
+        next[i - 1] = last[block];
+        last[block] = i - 1;
+    }
+
+    int result = cache_opt_replay(cache, addresses, TEST_TRACE_LENGTH, hits);
+    TEST_CHECK(result == 0, "OPT replay failed");
+
+    test_model_t model;
+    test_model_init(&model, cache->num_sets, 6);
+    size_t mismatches = 0, opt_hits = 0;
+    for (size_t i = 0; i < TEST_TRACE_LENGTH; i++) {
+        mismatches += hits[i] != test_model_access(&model, addresses[i] / 64, next[i], 0);
+        opt_hits += hits[i];
+    }
+    TEST_CHECK(mismatches == 0, "%zu accesses differ from the OPT model", mismatches);
+    test_model_free(&model);
+    cache_free(cache);
+
+    cache = cache_new(48 * 64 * 6, 64, 6, CACHE_REPLACEMENTPOLICY_LRU | CACHE_DATAPOLICY_NODATA);
+    size_t lru_hits = cache_replay(cache, addresses, TEST_TRACE_LENGTH, NULL, NULL, NULL, test_random);
+    TEST_CHECK(opt_hits >= lru_hits, "OPT hit %zu times, LRU %zu", opt_hits, lru_hits);
+    cache_free(cache);
+
+    free(last);
+    free(hits);
+    free(next);
+    free(addresses);
+}
+
+/*
+ * Set-bucketed replay: cache_replay_by_set gives every access and every
+ * set the same result as cache_replay, and refuses policies whose state
+ * is shared across sets.
+ */
+static void test_replay_by_set(void) {
+    static const int policies[] = {
+        CACHE_REPLACEMENTPOLICY_LRU,
+        CACHE_REPLACEMENTPOLICY_MRU,
+        CACHE_REPLACEMENTPOLICY_RANDOM,
+        CACHE_REPLACEMENTPOLICY_LRU | CACHE_INSERTIONPOLICY_BIP,
+    };
+    uint64_t *addresses = malloc(TEST_TRACE_LENGTH * sizeof(uint64_t));
+    uint8_t *hits = malloc(TEST_TRACE_LENGTH), *set_hits_by_set = malloc(TEST_TRACE_LENGTH);
+
+    test_trace(addresses, TEST_TRACE_LENGTH, 0, 64, 8192);
+    for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        cache_t *cache = cache_new(96 << 10, 64, 12, policies[p] | CACHE_DATAPOLICY_NODATA);
+        cache_t *bucketed = cache_new(96 << 10, 64, 12, policies[p] | CACHE_DATAPOLICY_NODATA);
+        uint64_t *set_counts = calloc(4 * (size_t)cache->num_sets, sizeof(uint64_t));
+        cache_set_random_streams(cache, 42);
+        cache_set_random_streams(bucketed, 42);
+
+        cache_replay(cache, addresses, TEST_TRACE_LENGTH, hits, set_counts, set_counts + cache->num_sets,
+                     test_random);
+        int result = cache_replay_by_set(bucketed, addresses, TEST_TRACE_LENGTH, set_hits_by_set,
+                                         set_counts + 2 * cache->num_sets, set_counts + 3 * cache->num_sets);
+        TEST_CHECK(result == 0, "policy %zu: set-bucketed replay refused", p);
+        TEST_CHECK(memcmp(hits, set_hits_by_set, TEST_TRACE_LENGTH) == 0,
+                   "policy %zu: set-bucketed replay diverges", p);
+        TEST_CHECK(memcmp(set_counts, set_counts + 2 * cache->num_sets, 2 * cache->num_sets * sizeof(uint64_t)) == 0,
+                   "policy %zu: set-bucketed replay counts sets differently", p);
+        TEST_CHECK(cache_miss_count(cache) == cache_miss_count(bucketed),
+                   "policy %zu: set-bucketed replay misses differ", p);
+
+        free(set_counts);
+        cache_free(bucketed);
+        cache_free(cache);
+    }
+
+    cache_t *cache = cache_new(96 << 10, 64, 12, CACHE_REPLACEMENTPOLICY_ADAPTIVE | CACHE_DATAPOLICY_NODATA);
+    TEST_CHECK(cache_replay_by_set(cache, addresses, TEST_TRACE_LENGTH, NULL, NULL, NULL) == -1,
+               "set-bucketed replay accepted the adaptive policy");
+    cache_free(cache);
+
+    free(set_hits_by_set);
+    free(hits);
+    free(addresses);
+}
+
+int main(void) {
+    test_geometries();
+    test_sectors();
+    test_snapshots();
+    test_forks();
+    test_opt();
+    test_replay_by_set();
+
+    if (test_failures != 0) {
+        fprintf(stderr, "%d checks failed\n", test_failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
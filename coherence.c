@@ -0,0 +1,287 @@
+#include "coherence.h"
+#include <stdlib.h>
+#include <inttypes.h>
+
+/*
+ * Associativity of the table of falsely shared lines.
+ */
+#define COHERENCE_TABLE_WAYS 16
+
+/*
+ * Create a coherent system over the given per-core caches.
+ */
+cache_system_t *cache_system_new(cache_t **caches, unsigned int num_cores, int protocol) {
+    for (unsigned int i = 0; i < num_cores; i++) {
+        if ((caches[i]->policies & CACHE_DATAPOLICY_MASK) != CACHE_DATAPOLICY_NODATA
+            || caches[i]->line_size != caches[0]->line_size) {
+            return NULL;
+        }
+    }
+
+    cache_system_t *system = (cache_system_t *)calloc(1, sizeof(cache_system_t));
+    system->caches = caches;
+    system->num_cores = num_cores;
+    system->protocol = protocol;
+
+    // A 64-bit mask covers the whole line, a byte per bit when it fits.
+    system->granule = (caches[0]->line_size + 63) / 64;
+
+    size_t total_lines = 0;
+    system->written_masks = (uint64_t **)malloc(num_cores * sizeof(uint64_t *));
+    for (unsigned int i = 0; i < num_cores; i++) {
+        system->written_masks[i] = (uint64_t *)calloc(caches[i]->num_lines, sizeof(uint64_t));
+        total_lines += caches[i]->num_lines;
+    }
+
+    system->num_false_sharing_sets = (total_lines + COHERENCE_TABLE_WAYS - 1) / COHERENCE_TABLE_WAYS;
+    system->false_sharing_lines = (cache_system_line_t *)calloc(system->num_false_sharing_sets * COHERENCE_TABLE_WAYS,
+                                                                sizeof(cache_system_line_t));
+
+    return system;
+}
+
+/*
+ * Frees the system, but not its caches.
+ */
+void cache_system_free(cache_system_t *system) {
+    for (unsigned int i = 0; i < system->num_cores; i++) {
+        free(system->written_masks[i]);
+    }
+    free(system->written_masks);
+    free(system->false_sharing_lines);
+    free(system);
+}
+
+/*
+ * Return the write mask bits covering size bytes at the given offset
+ * into a line.
+ */
+static uint64_t cache_system_mask(cache_system_t *system, size_t offset, size_t size) {
+    size_t line_size = system->caches[0]->line_size;
+    size_t first, last;
+
+    if (size == 0) {
+        size = 1;
+    }
+    if (offset + size > line_size) {
+        size = line_size - offset;
+    }
+    first = offset / system->granule;
+    last = (offset + size - 1) / system->granule;
+
+    uint64_t high = last == 63 ? ~(uint64_t)0 : ((uint64_t)1 << (last + 1)) - 1;
+    return high & ~(((uint64_t)1 << first) - 1);
+}
+
+/*
+ * Count a false sharing miss on a block, taking a free entry of its set
+ * or else the one with the fewest misses if the block has none.
+ */
+static void cache_system_count_false_sharing(cache_system_t *system, uint64_t block) {
+    size_t set = ((block * 0x9E3779B97F4A7C15ULL) >> 32) % system->num_false_sharing_sets;
+    cache_system_line_t *ways = &system->false_sharing_lines[set * COHERENCE_TABLE_WAYS];
+    cache_system_line_t *victim = &ways[0];
+
+    system->false_sharing_misses++;
+    for (int w = 0; w < COHERENCE_TABLE_WAYS; w++) {
+        if (ways[w].false_sharing_misses != 0 && ways[w].block == block) {
+            ways[w].false_sharing_misses++;
+            return;
+        }
+        if (ways[w].false_sharing_misses < victim->false_sharing_misses) {
+            victim = &ways[w];
+        }
+    }
+    if (victim->false_sharing_misses != 0) {
+        system->false_sharing_dropped++;
+    }
+    victim->block = block;
+    victim->false_sharing_misses = 1;
+}
+
+/*
+ * Broadcast a request from one core to all the others. A read downgrades
+ * the copies it finds to shared (or owned, under MOESI); a write
+ * invalidates them, and records the bytes written in the copies already
+ * invalid. Returns whether any other core kept a valid copy.
+ */
+static int cache_system_snoop(cache_system_t *system, unsigned int core, uintptr_t address,
+                              int is_write, uint64_t mask) {
+    int shared = 0;
+
+    for (unsigned int i = 0; i < system->num_cores; i++) {
+        if (i == core) {
+            continue;
+        }
+        cache_t *other = system->caches[i];
+        cache_line_t *line = cache_probe(other, address, 1);
+        if (line == NULL) {
+            continue;
+        }
+        uint64_t *written = &system->written_masks[i][line - other->lines];
+
+        if (cache_line_state(line) == CACHE_LINE_INVALID) {
+            if (is_write && *written != 0) {
+                *written |= mask;
+            }
+            continue;
+        }
+
+        if (is_write) {
+            if (cache_line_state(line) == CACHE_LINE_MODIFIED || cache_line_state(line) == CACHE_LINE_OWNED) {
+                system->interventions++;
+                system->flushes++;
+            }
+            cache_snoop(other, address, 1);
+            system->invalidations++;
+            *written = mask;
+            continue;
+        }
+
+        shared = 1;
+        switch (cache_line_state(line)) {
+        case CACHE_LINE_MODIFIED:
+            system->interventions++;
+            if (system->protocol == COHERENCE_MOESI) {
+                cache_line_set_state(line, CACHE_LINE_OWNED);
+            } else {
+                cache_snoop(other, address, 0);
+                system->flushes++;
+                cache_line_set_state(line, CACHE_LINE_SHARED);
+            }
+            break;
+        case CACHE_LINE_OWNED:
+            system->interventions++;
+            break;
+        case CACHE_LINE_EXCLUSIVE:
+            cache_line_set_state(line, CACHE_LINE_SHARED);
+            break;
+        }
+    }
+
+    return shared;
+}
+
+/*
+ * Perform a read or a write on one core, keeping the other caches
+ * coherent. Returns 1 on a hit and 0 on a miss.
+ */
+static int cache_system_access(cache_system_t *system, unsigned int core, uintptr_t address,
+                               size_t size, int is_write, func_t generate_random_number) {
+    cache_t *cache = system->caches[core];
+    uint64_t block = cache_block_number(cache, address);
+    size_t offset = address - block * cache->line_size;
+    uint64_t mask = cache_system_mask(system, offset, size);
+    cache_line_t *line = cache_probe(cache, address, 0);
+    int hit = line != NULL;
+    int shared = 0;
+
+    if (!hit) {
+        // A miss on a line another core invalidated is a coherence miss,
+        // and false sharing if none of the bytes wanted were written.
+        cache_line_t *stale = cache_probe(cache, address, 1);
+        if (stale != NULL && system->written_masks[core][stale - cache->lines] != 0) {
+            system->coherence_misses++;
+            if ((system->written_masks[core][stale - cache->lines] & mask) == 0) {
+                cache_system_count_false_sharing(system, block);
+            }
+        }
+
+        if (is_write) {
+            system->bus_read_exclusives++;
+        } else {
+            system->bus_reads++;
+        }
+        shared = cache_system_snoop(system, core, address, is_write, mask);
+    } else if (is_write) {
+        // Writes to shared or owned lines must invalidate the other
+        // copies first; writes to exclusive or modified lines are silent.
+        if (cache_line_state(line) == CACHE_LINE_SHARED || cache_line_state(line) == CACHE_LINE_OWNED) {
+            system->upgrades++;
+        }
+        cache_system_snoop(system, core, address, 1, mask);
+    }
+
+    if (is_write) {
+        cache_write(cache, address, 0, generate_random_number);
+    } else {
+        cache_read(cache, address, generate_random_number);
+    }
+
+    line = cache_probe(cache, address, 0);
+    if (line != NULL) {
+        system->written_masks[core][line - cache->lines] = 0;
+        if (is_write) {
+            cache_line_set_state(line, CACHE_LINE_MODIFIED);
+        } else if (!hit) {
+            cache_line_set_state(line, shared || system->protocol == COHERENCE_MSI
+                                       ? CACHE_LINE_SHARED : CACHE_LINE_EXCLUSIVE);
+        }
+    }
+
+    return hit;
+}
+
+/*
+ * Read size bytes at the given address on the given core.
+ */
+int cache_system_read(cache_system_t *system, unsigned int core, uintptr_t address,
+                      size_t size, func_t generate_random_number) {
+    return cache_system_access(system, core, address, size, 0, generate_random_number);
+}
+
+/*
+ * Write size bytes at the given address on the given core.
+ */
+int cache_system_write(cache_system_t *system, unsigned int core, uintptr_t address,
+                       size_t size, func_t generate_random_number) {
+    return cache_system_access(system, core, address, size, 1, generate_random_number);
+}
+
+/*
+ * Ordering of the falsely shared lines for the report.
+ */
+static int cache_system_by_false_sharing(const void *a, const void *b) {
+    const cache_system_line_t *x = a, *y = b;
+    return (x->false_sharing_misses < y->false_sharing_misses) - (x->false_sharing_misses > y->false_sharing_misses);
+}
+
+/*
+ * Print the per-core statistics, the coherence traffic and the most
+ * falsely shared lines.
+ */
+void cache_system_report(cache_system_t *system, FILE *out, unsigned int top) {
+    static const char *protocols[] = { "MSI", "MESI", "MOESI" };
+
+    fprintf(out, "protocol:           %s\n", protocols[system->protocol]);
+    for (unsigned int i = 0; i < system->num_cores; i++) {
+        cache_t *cache = system->caches[i];
+        fprintf(out, "core %-3u           %" PRIu64 " accesses, %" PRIu64 " misses\n",
+                i, cache_access_count(cache), cache_miss_count(cache));
+    }
+    fprintf(out, "bus reads:          %" PRIu64 "\n", system->bus_reads);
+    fprintf(out, "bus read-exclusive: %" PRIu64 "\n", system->bus_read_exclusives);
+    fprintf(out, "upgrades:           %" PRIu64 "\n", system->upgrades);
+    fprintf(out, "invalidations:      %" PRIu64 "\n", system->invalidations);
+    fprintf(out, "interventions:      %" PRIu64 "\n", system->interventions);
+    fprintf(out, "flushes:            %" PRIu64 "\n", system->flushes);
+    fprintf(out, "coherence misses:   %" PRIu64 "\n", system->coherence_misses);
+    fprintf(out, "false sharing:      %" PRIu64 "\n", system->false_sharing_misses);
+    if (system->false_sharing_dropped != 0) {
+        fprintf(out, "  (%" PRIu64 " lines dropped)\n", system->false_sharing_dropped);
+    }
+
+    size_t total = system->num_false_sharing_sets * COHERENCE_TABLE_WAYS, num_lines = 0;
+    cache_system_line_t *lines = malloc(total * sizeof(cache_system_line_t));
+    for (size_t i = 0; i < total; i++) {
+        if (system->false_sharing_lines[i].false_sharing_misses != 0) {
+            lines[num_lines++] = system->false_sharing_lines[i];
+        }
+    }
+    qsort(lines, num_lines, sizeof(cache_system_line_t), cache_system_by_false_sharing);
+    for (size_t i = 0; i < num_lines && i < top; i++) {
+        fprintf(out, "  0x%016" PRIx64 "  %10" PRIu64 " false sharing misses\n",
+                lines[i].block * system->caches[0]->line_size, lines[i].false_sharing_misses);
+    }
+    free(lines);
+}
@@ -0,0 +1,110 @@
+/*
+ * coherence.h
+ *
+ * A snooping bus that keeps the private caches of several cores coherent
+ * with the MSI, MESI or MOESI protocol, counting the bus traffic and the
+ * misses coherence causes.
+ */
+#ifndef COHERENCE_H
+#define COHERENCE_H
+
+#include "cache.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Coherence protocols.
+ */
+#define COHERENCE_MSI   0
+#define COHERENCE_MESI  1
+#define COHERENCE_MOESI 2
+
+/*
+ * Structure used to count the false sharing misses of one line.
+ */
+typedef struct cache_system_line_s {
+    /* The block number of the line, and its false sharing misses. */
+    uint64_t block, false_sharing_misses;
+} cache_system_line_t;
+
+/*
+ * Structure used to store a set of coherent caches, one per core.
+ */
+typedef struct cache_system_s {
+    /* The per-core caches and the protocol keeping them coherent. */
+    cache_t **caches;
+    unsigned int num_cores;
+    int protocol;
+
+    /* Number of bytes of a line covered by each bit of a write mask. */
+    size_t granule;
+
+    /* For every core and each of its lines invalidated by another
+     * core, the parts of the block written since; 0 for other lines. */
+    uint64_t **written_masks;
+
+    /* Bus transactions: reads, reads for ownership, upgrades of shared
+     * lines, copies invalidated, dirty lines supplied by another cache,
+     * and dirty lines written back because of a snoop. */
+    uint64_t bus_reads, bus_read_exclusives, upgrades;
+    uint64_t invalidations, interventions, flushes;
+
+    /* Misses on a line another core invalidated, and those among them
+     * where none of the bytes accessed had been written since: the
+     * line was falsely shared. */
+    uint64_t coherence_misses, false_sharing_misses;
+
+    /* The lines with false sharing misses, one entry per block in a
+     * set-associative table of as many entries as the caches have
+     * lines in all. When a set is full the line with the fewest misses is
+     * replaced, and counted. */
+    cache_system_line_t *false_sharing_lines;
+    size_t num_false_sharing_sets;
+    uint64_t false_sharing_dropped;
+} cache_system_t;
+
+/* Public functions */
+
+/*
+ * Create a coherent system over the given per-core caches, which remain
+ * owned by the caller. The system only tracks line states, so the caches
+ * must be tag-only (CACHE_DATAPOLICY_NODATA), and they must all have the
+ * same line size. They should be write-back and write-allocate for
+ * write-back traffic to be counted. Returns NULL if the caches are not
+ * suitable.
+ */
+cache_system_t *cache_system_new(cache_t **caches, unsigned int num_cores, int protocol);
+
+/*
+ * Frees the system, but not its caches.
+ */
+void cache_system_free(cache_system_t *system);
+
+/*
+ * Read size bytes at the given address on the given core. Returns 1 on
+ * a hit in that core's cache and 0 on a miss.
+ */
+int cache_system_read(cache_system_t *system, unsigned int core, uintptr_t address,
+                      size_t size, func_t generate_random_number);
+
+/*
+ * Write size bytes at the given address on the given core. Returns 1 on
+ * a hit in that core's cache and 0 on a miss; a hit on a shared line
+ * still needs an upgrade on the bus.
+ */
+int cache_system_write(cache_system_t *system, unsigned int core, uintptr_t address,
+                       size_t size, func_t generate_random_number);
+
+/*
+ * Print the per-core statistics and the coherence traffic to the given
+ * stream, followed by up to top lines ranked by false sharing misses.
+ */
+void cache_system_report(cache_system_t *system, FILE *out, unsigned int top);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
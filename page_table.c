@@ -0,0 +1,284 @@
+#include "page_table.h"
+#include <stdlib.h>
+#include <inttypes.h>
+
+/*
+ * Return the greatest common divisor of two numbers.
+ */
+static uint64_t page_table_gcd(uint64_t a, uint64_t b) {
+    while (b != 0) {
+        uint64_t r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+/*
+ * Return the number of page colors of a cache. A page of L lines in
+ * frame f starts at set f * L modulo the number of sets N, which takes
+ * N / gcd(N, L) distinct values, so frames are the same color exactly
+ * when they are equal modulo that number. When N is a multiple of L this
+ * is the usual N / L.
+ */
+unsigned int page_table_colors(cache_t *cache, size_t page_size) {
+    size_t span = (size_t)cache->num_sets * cache->line_size;
+    if (span <= page_size) {
+        return 1;
+    }
+    if (cache->line_size >= page_size) {
+        return span / page_size;
+    }
+    uint64_t lines_per_page = page_size / cache->line_size;
+    return cache->num_sets / page_table_gcd(cache->num_sets, lines_per_page);
+}
+
+/*
+ * Return the color of set s: that of the pages whose lines start at s,
+ * or at the closest start below it. When pages hold several lines, the
+ * starts are the multiples of g = gcd(N, L), and the color c starting
+ * at s = k * g solves c * (L / g) = k modulo the number of colors.
+ */
+static unsigned int page_table_set_color(cache_t *cache, size_t page_size, unsigned int s) {
+    if ((size_t)cache->num_sets * cache->line_size <= page_size) {
+        return 0;
+    }
+    if (cache->line_size >= page_size) {
+        return (uint64_t)s * cache->line_size / page_size;
+    }
+    uint64_t lines_per_page = page_size / cache->line_size;
+    uint64_t g = page_table_gcd(cache->num_sets, lines_per_page);
+    int64_t colors = cache->num_sets / g, step = (lines_per_page / g) % colors;
+
+    // Extended Euclid for the inverse of step modulo colors.
+    int64_t r0 = colors, r1 = step, t0 = 0, t1 = 1;
+    while (r1 != 0) {
+        int64_t q = r0 / r1, r = r0 - q * r1, t = t0 - q * t1;
+        r0 = r1;
+        r1 = r;
+        t0 = t1;
+        t1 = t;
+    }
+    uint64_t inverse = (uint64_t)((t0 % colors + colors) % colors);
+    return (unsigned int)(s / g * inverse % colors);
+}
+
+/*
+ * Create a page table.
+ */
+page_table_t *page_table_new(size_t page_size, uint64_t memory_bytes, int allocator,
+                             unsigned int num_colors, uint64_t seed) {
+    if (page_size == 0 || (page_size & (page_size - 1)) != 0 || num_colors == 0
+        || memory_bytes < page_size * num_colors) {
+        return NULL;
+    }
+
+    page_table_t *table = (page_table_t *)calloc(1, sizeof(page_table_t));
+    table->page_size = page_size;
+    table->page_shift = __builtin_ctzll(page_size);
+    table->capacity = 1024;
+    table->keys = (uint64_t *)calloc(table->capacity, sizeof(uint64_t));
+    table->frames = (uint64_t *)malloc(table->capacity * sizeof(uint64_t));
+    table->num_frames = memory_bytes / page_size;
+    table->allocator = allocator;
+    table->num_colors = num_colors;
+    table->color_pages = (uint64_t *)calloc(num_colors, sizeof(uint64_t));
+    table->color_next = (uint64_t *)calloc(num_colors, sizeof(uint64_t));
+
+    table->random_modulus = 1;
+    while (table->random_modulus < table->num_frames) {
+        table->random_modulus <<= 1;
+    }
+    // Keys of the random permutation: two odd outputs of splitmix64.
+    for (int round = 0; round < 2; round++) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        table->random_keys[round] = (z ^ (z >> 31)) | 1;
+    }
+
+    return table;
+}
+
+/*
+ * Frees all memory allocated for the page table.
+ */
+void page_table_free(page_table_t *table) {
+    free(table->keys);
+    free(table->frames);
+    free(table->color_pages);
+    free(table->color_next);
+    free(table);
+}
+
+/*
+ * Return the slot of a virtual page in the hash table: either the one
+ * holding it or the empty one where it belongs.
+ */
+static size_t page_table_slot(page_table_t *table, uint64_t page) {
+    uint64_t key = page + 1;
+    size_t mask = table->capacity - 1;
+    size_t slot = (key * 0x9E3779B97F4A7C15ULL) >> 20 & mask;
+
+    while (table->keys[slot] != 0 && table->keys[slot] != key) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/*
+ * Record a mapping, growing the hash table when it gets half full.
+ */
+static void page_table_insert(page_table_t *table, uint64_t page, uint64_t frame) {
+    if (2 * (table->count + 1) > table->capacity) {
+        uint64_t *keys = table->keys, *frames = table->frames;
+        size_t capacity = table->capacity;
+
+        table->capacity *= 2;
+        table->keys = (uint64_t *)calloc(table->capacity, sizeof(uint64_t));
+        table->frames = (uint64_t *)malloc(table->capacity * sizeof(uint64_t));
+        for (size_t i = 0; i < capacity; i++) {
+            if (keys[i] != 0) {
+                size_t slot = page_table_slot(table, keys[i] - 1);
+                table->keys[slot] = keys[i];
+                table->frames[slot] = frames[i];
+            }
+        }
+        free(keys);
+        free(frames);
+    }
+
+    size_t slot = page_table_slot(table, page);
+    if (table->keys[slot] == 0) {
+        table->count++;
+    } else {
+        table->color_pages[table->frames[slot] % table->num_colors]--;
+    }
+    table->keys[slot] = page + 1;
+    table->frames[slot] = frame;
+    table->color_pages[frame % table->num_colors]++;
+}
+
+/*
+ * Scatter a frame index over the frames. Each round, an addition and a
+ * multiplication by an odd key then a fold of the high bits into the
+ * low ones, is a bijection over [0, random_modulus), and results past
+ * the last frame are permuted again until one lands inside. This is the
+ * cycle-walking of workload_permute, except that the key is also added
+ * before multiplying so that frame 0 is not a fixed point. Unlike the
+ * low bits of a power-of-two LCG, the colors of the frames follow no
+ * short cycle.
+ */
+static uint64_t page_table_permute(page_table_t *table, uint64_t x) {
+    uint64_t mask = table->random_modulus - 1;
+    unsigned int shift = __builtin_ctzll(table->random_modulus) / 2 + 1;
+
+    do {
+        for (int round = 0; round < 2; round++) {
+            x = ((x + table->random_keys[round]) * table->random_keys[round]) & mask;
+            x ^= x >> shift;
+        }
+    } while (x >= table->num_frames);
+    return x;
+}
+
+/*
+ * Pick a frame for a virtual page that has none.
+ */
+static uint64_t page_table_allocate(page_table_t *table, uint64_t page) {
+    uint64_t frame;
+
+    switch (table->allocator) {
+    case PAGE_ALLOC_RANDOM:
+        // Every frame is handed out once before any repeats.
+        frame = page_table_permute(table, table->allocated % table->num_frames);
+        break;
+    case PAGE_ALLOC_COLORED: {
+        unsigned int color = page % table->num_colors;
+        uint64_t frames_per_color = table->num_frames / table->num_colors;
+        frame = (table->color_next[color]++ % frames_per_color) * table->num_colors + color;
+        break;
+    }
+    default:
+        frame = table->allocated % table->num_frames;
+        break;
+    }
+
+    table->allocated++;
+    return frame;
+}
+
+/*
+ * Map the page holding a virtual address to the frame holding a
+ * physical address.
+ */
+void page_table_map(page_table_t *table, uintptr_t virtual_address, uintptr_t physical_address) {
+    page_table_insert(table, virtual_address >> table->page_shift, physical_address >> table->page_shift);
+}
+
+/*
+ * Read mappings from a stream.
+ */
+size_t page_table_load(page_table_t *table, FILE *in) {
+    uint64_t virtual_address, physical_address;
+    size_t count = 0;
+
+    while (fscanf(in, "%" SCNx64 " %" SCNx64, &virtual_address, &physical_address) == 2) {
+        page_table_map(table, virtual_address, physical_address);
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Translate a virtual address.
+ */
+uintptr_t page_table_translate(void *context, uintptr_t virtual_address) {
+    page_table_t *table = context;
+    uint64_t page = virtual_address >> table->page_shift;
+    size_t slot = page_table_slot(table, page);
+    uint64_t frame;
+
+    if (table->keys[slot] != 0) {
+        frame = table->frames[slot];
+    } else {
+        frame = page_table_allocate(table, page);
+        page_table_insert(table, page, frame);
+    }
+    return (frame << table->page_shift) | (virtual_address & (table->page_size - 1));
+}
+
+/*
+ * Count the valid lines of a physically indexed cache per page color.
+ */
+void page_table_color_occupancy(page_table_t *table, cache_t *cache, uint64_t *counts) {
+    for (unsigned int c = 0; c < table->num_colors; c++) {
+        counts[c] = 0;
+    }
+    for (unsigned int s = 0; s < cache->num_sets; s++) {
+        cache_set_t *set = &cache->sets[s];
+        unsigned int color = page_table_set_color(cache, table->page_size, s) % table->num_colors;
+        for (int i = 0; i < set->size; i++) {
+            if (cache_line_state(&set->lines[set->first_index + i]) != CACHE_LINE_INVALID) {
+                counts[color]++;
+            }
+        }
+    }
+}
+
+/*
+ * Print the pages and cache lines of every color.
+ */
+void page_table_report(page_table_t *table, cache_t *cache, FILE *out) {
+    uint64_t *counts = malloc(table->num_colors * sizeof(uint64_t));
+    uint64_t lines_per_color = cache->num_lines / table->num_colors;
+
+    page_table_color_occupancy(table, cache, counts);
+    fprintf(out, "pages mapped:     %zu\n", table->count);
+    for (unsigned int c = 0; c < table->num_colors; c++) {
+        fprintf(out, "color %-4u        %8" PRIu64 " pages  %8" PRIu64 " lines (%.1f%%)\n",
+                c, table->color_pages[c], counts[c],
+                lines_per_color ? 100.0 * counts[c] / lines_per_color : 0.0);
+    }
+    free(counts);
+}
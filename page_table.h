@@ -0,0 +1,114 @@
+/*
+ * page_table.h
+ *
+ * Virtual-to-physical translation, so that physically indexed caches can
+ * be modelled from traces of virtual addresses. Pages are either mapped
+ * explicitly, for instance from a dump of a real page table, or given a
+ * frame on first touch by one of several allocators.
+ */
+#ifndef PAGE_TABLE_H
+#define PAGE_TABLE_H
+
+#include <stdio.h>
+#include "cache.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Frame allocators used for pages that were not mapped explicitly.
+ * Sequential hands out frames in order, random in a pseudo-random order
+ * set by the seed, and colored picks a frame of the same color as the virtual
+ * page, as an OS that colors pages would.
+ */
+#define PAGE_ALLOC_SEQUENTIAL 0
+#define PAGE_ALLOC_RANDOM     1
+#define PAGE_ALLOC_COLORED    2
+
+/*
+ * Structure used to store a page table.
+ */
+typedef struct page_table_s {
+    /* Page size, a power of two, and its log. */
+    size_t page_size;
+    unsigned int page_shift;
+
+    /* Hash table from virtual page number + 1 (0 marks an empty slot)
+     * to physical frame number. */
+    uint64_t *keys, *frames;
+    size_t capacity, count;
+
+    /* Number of physical frames, and the allocator handing them out. */
+    uint64_t num_frames;
+    int allocator;
+
+    /* Allocator state: frames handed out so far, and for the random
+     * allocator the keys of the bijection over random_modulus (the
+     * power of two at or above num_frames) that scatters them. */
+    uint64_t allocated, random_keys[2], random_modulus;
+
+    /* Number of page colors, and per color the pages mapped to it and
+     * the next frame the colored allocator hands out. */
+    unsigned int num_colors;
+    uint64_t *color_pages, *color_next;
+} page_table_t;
+
+/* Public functions */
+
+/*
+ * Return the number of page colors of a cache: the number of distinct
+ * pages that map to different sets, or 1 if a page covers every set.
+ */
+unsigned int page_table_colors(cache_t *cache, size_t page_size);
+
+/*
+ * Create a page table for memory_bytes of physical memory in pages of
+ * page_size bytes (a power of two), with the given allocator, number of
+ * colors and random seed. Allocation wraps around once physical memory
+ * is exhausted. Returns NULL if the parameters are invalid.
+ */
+page_table_t *page_table_new(size_t page_size, uint64_t memory_bytes, int allocator,
+                             unsigned int num_colors, uint64_t seed);
+
+/*
+ * Frees all memory allocated for the page table.
+ */
+void page_table_free(page_table_t *table);
+
+/*
+ * Map the page holding a virtual address to the frame holding a
+ * physical address.
+ */
+void page_table_map(page_table_t *table, uintptr_t virtual_address, uintptr_t physical_address);
+
+/*
+ * Read mappings from a stream, one "<virtual> <physical>" pair of
+ * hexadecimal addresses per line. Returns the number of mappings read.
+ */
+size_t page_table_load(page_table_t *table, FILE *in);
+
+/*
+ * Translate a virtual address, allocating a frame for its page if it has
+ * none. The context is the page table, so this can be used as a TLB's
+ * translation function.
+ */
+uintptr_t page_table_translate(void *table, uintptr_t virtual_address);
+
+/*
+ * Count the valid lines of a physically indexed cache per page color.
+ * counts must have room for the table's number of colors.
+ */
+void page_table_color_occupancy(page_table_t *table, cache_t *cache, uint64_t *counts);
+
+/*
+ * Print, for each color, the pages mapped to it and the lines of the
+ * cache it occupies.
+ */
+void page_table_report(page_table_t *table, cache_t *cache, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
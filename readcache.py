@@ -0,0 +1,126 @@
+"""
+readcache.py
+
+Python bindings for the cache simulator, through ctypes. Build the
+shared library first:
+
+    cc -O2 -shared -fPIC -o libcache.so cache.c
+
+Address arrays are handed to the native replay loop without a copy, and
+ctypes releases the GIL while it runs, so other Python threads keep
+going during long replays:
+
+    import numpy as np
+    from readcache import Cache, REPLACEMENT_LRU
+
+    cache = Cache(32 * 1024, 64, 8, REPLACEMENT_LRU)
+    hits, set_hits, set_misses = cache.replay(np.arange(0, 1 << 20, 8, dtype=np.uint64))
+"""
+
+import ctypes
+import os
+
+import numpy as np
+
+# Policies, as in cache.h. Caches created from Python are always
+# tag-only: the addresses replayed are not mapped in this process.
+REPLACEMENT_RANDOM = 0b00000000
+REPLACEMENT_LRU = 0b00000100
+REPLACEMENT_MRU = 0b00001000
+REPLACEMENT_ADAPTIVE = 0b00001100
+INSERTION_MRU = 0b00000000
+INSERTION_LIP = 0b01000000
+INSERTION_BIP = 0b10000000
+INSERTION_DIP = 0b11000000
+WRITE_BACK = 0b00000001
+WRITE_NO_ALLOCATE = 0b00000010
+BYPASS = 0b100000000
+_NODATA = 0b00100000
+
+_lib = ctypes.CDLL(os.environ.get("READCACHE_LIBRARY",
+                                  os.path.join(os.path.dirname(os.path.abspath(__file__)), "libcache.so")))
+
+_lib.cache_new.restype = ctypes.c_void_p
+_lib.cache_new.argtypes = [ctypes.c_size_t, ctypes.c_size_t, ctypes.c_uint, ctypes.c_int]
+_lib.cache_free.argtypes = [ctypes.c_void_p]
+_lib.cache_replay.restype = ctypes.c_size_t
+_lib.cache_replay.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t, ctypes.c_void_p,
+                              ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]
+_lib.cache_replay_by_set.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t, ctypes.c_void_p,
+                                     ctypes.c_void_p, ctypes.c_void_p]
+_lib.cache_set_random_streams.argtypes = [ctypes.c_void_p, ctypes.c_uint64]
+_lib.cache_opt_replay.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t, ctypes.c_void_p]
+_lib.cache_access_count.restype = ctypes.c_uint64
+_lib.cache_access_count.argtypes = [ctypes.c_void_p]
+_lib.cache_miss_count.restype = ctypes.c_uint64
+_lib.cache_miss_count.argtypes = [ctypes.c_void_p]
+
+
+class Cache:
+    """A tag-only cache, driven a whole array of addresses at a time."""
+
+    def __init__(self, num_bytes, line_size, associativity, policies=REPLACEMENT_LRU):
+        self._cache = _lib.cache_new(num_bytes, line_size, associativity, policies | _NODATA)
+        if not self._cache:
+            raise ValueError("impossible cache geometry")
+        self.num_sets = num_bytes // line_size // associativity
+
+    def __del__(self):
+        if getattr(self, "_cache", None):
+            _lib.cache_free(self._cache)
+            self._cache = None
+
+    def replay(self, addresses):
+        """
+        Replay an array of addresses. Returns a uint8 array with 1 for
+        every access that hit, and the per-set hit and miss counts of
+        this replay as uint64 arrays.
+        """
+        addresses = np.ascontiguousarray(addresses, dtype=np.uint64)
+        hits = np.empty(len(addresses), dtype=np.uint8)
+        set_hits = np.zeros(self.num_sets, dtype=np.uint64)
+        set_misses = np.zeros(self.num_sets, dtype=np.uint64)
+        _lib.cache_replay(self._cache, addresses.ctypes.data, len(addresses), hits.ctypes.data,
+                          set_hits.ctypes.data, set_misses.ctypes.data, None)
+        return hits, set_hits, set_misses
+
+    def replay_by_set(self, addresses):
+        """
+        Replay an array of addresses set by set, with the same results as
+        replay but better locality on large caches. Raises ValueError if
+        the cache's policies share state across sets.
+        """
+        addresses = np.ascontiguousarray(addresses, dtype=np.uint64)
+        hits = np.empty(len(addresses), dtype=np.uint8)
+        set_hits = np.zeros(self.num_sets, dtype=np.uint64)
+        set_misses = np.zeros(self.num_sets, dtype=np.uint64)
+        if _lib.cache_replay_by_set(self._cache, addresses.ctypes.data, len(addresses), hits.ctypes.data,
+                                    set_hits.ctypes.data, set_misses.ctypes.data) != 0:
+            raise ValueError("policies cannot be replayed set by set")
+        return hits, set_hits, set_misses
+
+    def random_streams(self, seed):
+        """
+        Give every set its own random number stream, so random policies
+        can be replayed set by set and runs are reproducible.
+        """
+        _lib.cache_set_random_streams(self._cache, seed)
+
+    def opt_replay(self, addresses):
+        """
+        Replay an array of addresses under Belady's optimal replacement.
+        Returns a uint8 array with 1 for every access that hit.
+        """
+        addresses = np.ascontiguousarray(addresses, dtype=np.uint64)
+        hits = np.empty(len(addresses), dtype=np.uint8)
+        if _lib.cache_opt_replay(self._cache, addresses.ctypes.data, len(addresses), hits.ctypes.data) != 0:
+            raise OSError("could not spill next uses to a temporary file")
+        return hits
+
+    @property
+    def accesses(self):
+        return _lib.cache_access_count(self._cache)
+
+    @property
+    def misses(self):
+        return _lib.cache_miss_count(self._cache)
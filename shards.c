@@ -0,0 +1,333 @@
+#include "shards.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+/*
+ * Return the sampling hash of a block, in [0, SHARDS_MODULUS). The
+ * constant keeps block 0, often the hottest, from always being sampled.
+ */
+static uint64_t shards_hash(uint64_t block) {
+    block ^= 0x9E3779B97F4A7C15ULL;
+    block ^= block >> 33;
+    block *= 0xff51afd7ed558ccdULL;
+    block ^= block >> 33;
+    block *= 0xc4ceb9fe1a85ec53ULL;
+    block ^= block >> 33;
+    return block & (SHARDS_MODULUS - 1);
+}
+
+/*
+ * Create a sampler.
+ */
+shards_t *shards_new(size_t line_size, uint64_t max_bytes, unsigned int num_bins,
+                     size_t max_samples, double rate) {
+    if (line_size == 0 || num_bins == 0 || max_samples == 0 || !(rate > 0 && rate <= 1)
+        || max_bytes / line_size < num_bins) {
+        return NULL;
+    }
+
+    shards_t *shards = (shards_t *)calloc(1, sizeof(shards_t));
+    shards->line_size = line_size;
+    shards->num_bins = num_bins;
+    shards->bin_width = max_bytes / line_size / num_bins;
+    shards->bins = (double *)calloc(num_bins, sizeof(double));
+    shards->threshold = (uint64_t)(rate * SHARDS_MODULUS);
+    if (shards->threshold == 0) {
+        shards->threshold = 1;
+    }
+
+    shards->capacity = 16;
+    while (shards->capacity < 2 * (max_samples + 1)) {
+        shards->capacity *= 2;
+    }
+    shards->keys = (uint64_t *)calloc(shards->capacity, sizeof(uint64_t));
+    shards->times = (uint64_t *)malloc(shards->capacity * sizeof(uint64_t));
+
+    // One spare heap slot, as a block is added before the bound is
+    // enforced.
+    shards->max_samples = max_samples;
+    shards->heap_hashes = (uint64_t *)malloc((max_samples + 1) * sizeof(uint64_t));
+    shards->heap_blocks = (uint64_t *)malloc((max_samples + 1) * sizeof(uint64_t));
+    shards->window = 4 * (max_samples + 1);
+    shards->tree = (uint32_t *)calloc(shards->window + 1, sizeof(uint32_t));
+
+    return shards;
+}
+
+/*
+ * Frees all memory allocated for the sampler.
+ */
+void shards_free(shards_t *shards) {
+    free(shards->bins);
+    free(shards->keys);
+    free(shards->times);
+    free(shards->heap_hashes);
+    free(shards->heap_blocks);
+    free(shards->tree);
+    free(shards);
+}
+
+/*
+ * Add delta to the count of blocks last accessed at a time.
+ */
+static void shards_tree_add(shards_t *shards, uint64_t time, int32_t delta) {
+    for (uint64_t i = time + 1; i <= shards->window; i += i & -i) {
+        shards->tree[i] += delta;
+    }
+}
+
+/*
+ * Return the number of blocks last accessed after a time.
+ */
+static uint64_t shards_tree_count_after(shards_t *shards, uint64_t time) {
+    uint64_t count = 0;
+    for (uint64_t i = time + 1; i > 0; i -= i & -i) {
+        count += shards->tree[i];
+    }
+    return shards->count - count;
+}
+
+/*
+ * A time in use and the hash table slot holding it, for renumbering.
+ */
+typedef struct shards_time_s {
+    uint64_t time;
+    size_t slot;
+} shards_time_t;
+
+static int shards_time_compare(const void *a, const void *b) {
+    uint64_t x = ((const shards_time_t *)a)->time, y = ((const shards_time_t *)b)->time;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Renumber the times in use from 0, keeping their order, and rebuild
+ * the tree. The window is a few times the number of blocks tracked, so
+ * this is rare.
+ */
+static void shards_renumber(shards_t *shards) {
+    shards_time_t *times = (shards_time_t *)malloc(shards->count * sizeof(shards_time_t));
+    size_t n = 0;
+    for (size_t slot = 0; slot < shards->capacity; slot++) {
+        if (shards->keys[slot] != 0) {
+            times[n].time = shards->times[slot];
+            times[n].slot = slot;
+            n++;
+        }
+    }
+    qsort(times, n, sizeof(shards_time_t), shards_time_compare);
+
+    memset(shards->tree, 0, (shards->window + 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < n; i++) {
+        shards->times[times[i].slot] = i;
+        shards_tree_add(shards, i, 1);
+    }
+    shards->now = n;
+    free(times);
+}
+
+/*
+ * Return the slot of a block in the hash table: either the one holding
+ * it or the empty one where it belongs.
+ */
+static size_t shards_slot(shards_t *shards, uint64_t block) {
+    uint64_t key = block + 1;
+    size_t mask = shards->capacity - 1;
+    size_t slot = (key * 0x9E3779B97F4A7C15ULL) >> 20 & mask;
+
+    while (shards->keys[slot] != 0 && shards->keys[slot] != key) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/*
+ * Empty a slot of the hash table, moving back the entries after it that
+ * would no longer be found.
+ */
+static void shards_remove_slot(shards_t *shards, size_t slot) {
+    size_t mask = shards->capacity - 1;
+    size_t next = slot;
+
+    for (;;) {
+        next = (next + 1) & mask;
+        if (shards->keys[next] == 0) {
+            break;
+        }
+        size_t home = (shards->keys[next] * 0x9E3779B97F4A7C15ULL) >> 20 & mask;
+        int movable = slot <= next ? (home <= slot || home > next) : (home <= slot && home > next);
+        if (movable) {
+            shards->keys[slot] = shards->keys[next];
+            shards->times[slot] = shards->times[next];
+            slot = next;
+        }
+    }
+    shards->keys[slot] = 0;
+}
+
+/*
+ * Heap operations, the largest hash on top.
+ */
+static void shards_heap_swap(shards_t *shards, size_t a, size_t b) {
+    uint64_t hash = shards->heap_hashes[a], block = shards->heap_blocks[a];
+    shards->heap_hashes[a] = shards->heap_hashes[b];
+    shards->heap_blocks[a] = shards->heap_blocks[b];
+    shards->heap_hashes[b] = hash;
+    shards->heap_blocks[b] = block;
+}
+
+static void shards_heap_push(shards_t *shards, uint64_t hash, uint64_t block) {
+    size_t i = shards->count++;
+    shards->heap_hashes[i] = hash;
+    shards->heap_blocks[i] = block;
+    while (i > 0 && shards->heap_hashes[(i - 1) / 2] < shards->heap_hashes[i]) {
+        shards_heap_swap(shards, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void shards_heap_pop(shards_t *shards) {
+    size_t i = 0;
+    shards_heap_swap(shards, 0, --shards->count);
+    for (;;) {
+        size_t largest = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < shards->count && shards->heap_hashes[left] > shards->heap_hashes[largest]) {
+            largest = left;
+        }
+        if (right < shards->count && shards->heap_hashes[right] > shards->heap_hashes[largest]) {
+            largest = right;
+        }
+        if (largest == i) {
+            break;
+        }
+        shards_heap_swap(shards, i, largest);
+        i = largest;
+    }
+}
+
+/*
+ * Lower the threshold to the largest hash sampled, drop every block at
+ * or above it, and scale what was counted at the old rate down to the
+ * new one.
+ */
+static void shards_lower_threshold(shards_t *shards) {
+    uint64_t threshold = shards->heap_hashes[0];
+
+    while (shards->count > 0 && shards->heap_hashes[0] >= threshold) {
+        size_t slot = shards_slot(shards, shards->heap_blocks[0]);
+        shards_tree_add(shards, shards->times[slot], -1);
+        shards_remove_slot(shards, slot);
+        shards_heap_pop(shards);
+    }
+
+    double scale = (double)threshold / shards->threshold;
+    for (unsigned int i = 0; i < shards->num_bins; i++) {
+        shards->bins[i] *= scale;
+    }
+    shards->beyond *= scale;
+    shards->cold *= scale;
+    shards->sampled *= scale;
+    shards->threshold = threshold;
+}
+
+/*
+ * Record an access to a block number.
+ */
+void shards_observe(void *arg, uint64_t block) {
+    shards_t *shards = arg;
+    shards->references++;
+
+    uint64_t hash = shards_hash(block);
+    if (hash >= shards->threshold) {
+        return;
+    }
+
+    if (shards->now == shards->window) {
+        shards_renumber(shards);
+    }
+    size_t slot = shards_slot(shards, block);
+    shards->sampled++;
+
+    if (shards->keys[slot] != 0) {
+        // Reuse: the distance is the number of distinct sampled blocks
+        // accessed since, scaled up by the sampling rate.
+        uint64_t distance = shards_tree_count_after(shards, shards->times[slot]);
+        uint64_t scaled = (uint64_t)((double)distance * SHARDS_MODULUS / shards->threshold);
+        uint64_t bin = scaled / shards->bin_width;
+        if (bin < shards->num_bins) {
+            shards->bins[bin]++;
+        } else {
+            shards->beyond++;
+        }
+        shards_tree_add(shards, shards->times[slot], -1);
+        shards->times[slot] = shards->now;
+        shards_tree_add(shards, shards->now++, 1);
+        return;
+    }
+
+    shards->cold++;
+    shards->keys[slot] = block + 1;
+    shards->times[slot] = shards->now;
+    shards_tree_add(shards, shards->now++, 1);
+    shards_heap_push(shards, hash, block);
+    if (shards->count > shards->max_samples) {
+        shards_lower_threshold(shards);
+    }
+}
+
+/*
+ * Record an access to an address.
+ */
+void shards_access(shards_t *shards, uintptr_t address) {
+    shards_observe(shards, address / shards->line_size);
+}
+
+/*
+ * Return the current sampling rate.
+ */
+double shards_rate(shards_t *shards) {
+    return (double)shards->threshold / SHARDS_MODULUS;
+}
+
+/*
+ * Return the estimated miss ratio of a fully associative LRU cache.
+ *
+ * The number of sampled accesses is expected to be references times the
+ * rate; the difference from the actual number is added to the shortest
+ * distances (SHARDS-adj), which corrects for the bias of a few hot
+ * blocks being in or out of the sample.
+ */
+double shards_miss_ratio(shards_t *shards, uint64_t cache_bytes) {
+    double expected = shards->references * shards_rate(shards);
+    if (expected <= 0) {
+        return 1.0;
+    }
+
+    double lines = (double)cache_bytes / shards->line_size;
+    double hits = expected - shards->sampled;
+    for (unsigned int i = 0; i < shards->num_bins; i++) {
+        double start = (double)i * shards->bin_width;
+        if (lines <= start) {
+            break;
+        }
+        double covered = (lines - start) / shards->bin_width;
+        hits += shards->bins[i] * (covered < 1 ? covered : 1);
+    }
+
+    double ratio = 1.0 - hits / expected;
+    return ratio < 0 ? 0 : ratio > 1 ? 1 : ratio;
+}
+
+/*
+ * Print the miss ratio curve.
+ */
+void shards_report(shards_t *shards, FILE *out) {
+    fprintf(out, "references:       %" PRIu64 "\n", shards->references);
+    fprintf(out, "sampling rate:    %.6f\n", shards_rate(shards));
+    fprintf(out, "blocks tracked:   %zu\n", shards->count);
+    for (unsigned int i = 1; i <= shards->num_bins; i++) {
+        uint64_t bytes = (uint64_t)i * shards->bin_width * shards->line_size;
+        fprintf(out, "%12" PRIu64 " bytes: %.4f\n", bytes, shards_miss_ratio(shards, bytes));
+    }
+}
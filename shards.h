@@ -0,0 +1,116 @@
+/*
+ * shards.h
+ *
+ * Online miss ratio curve estimation with SHARDS (Waldspurger et al.,
+ * FAST '15): reuse distances are measured exactly, but only for the
+ * blocks whose hash falls below a threshold, and scaled up by the
+ * sampling rate. The number of blocks tracked is bounded, so memory
+ * stays constant however long the stream: when the bound is reached,
+ * the threshold is lowered to drop the blocks with the largest hashes.
+ *
+ * The curve is that of a fully associative LRU cache of every size up
+ * to a maximum. A sampler can be attached to a cache_t so that a single
+ * replay yields both the cache's statistics and the curve.
+ */
+#ifndef SHARDS_H
+#define SHARDS_H
+
+#include <stdio.h>
+#include "cache.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Range of the sampling hash: a block is sampled if its hash is below
+ * the threshold, so the sampling rate is threshold / SHARDS_MODULUS.
+ */
+#define SHARDS_MODULUS (1 << 24)
+
+/*
+ * Structure used to store a sampler.
+ */
+typedef struct shards_s {
+    /* Line size, and the histogram of scaled reuse distances: num_bins
+     * bins of bin_width blocks, then the distances beyond them, then
+     * first references. */
+    size_t line_size;
+    uint64_t bin_width;
+    unsigned int num_bins;
+    double *bins;
+    double beyond, cold;
+
+    /* Sampling threshold, accesses seen, and sampled accesses (scaled
+     * back when the threshold drops). */
+    uint64_t threshold, references;
+    double sampled;
+
+    /* Hash table from block number + 1 (0 marks an empty slot) to the
+     * time of its last sampled access. */
+    uint64_t *keys, *times;
+    size_t capacity;
+
+    /* Max-heap of the sampled blocks by hash, so the ones to drop when
+     * the threshold is lowered can be found. */
+    uint64_t *heap_hashes, *heap_blocks;
+    size_t count, max_samples;
+
+    /* Fenwick tree over the times of last access of the sampled blocks,
+     * so the number of blocks accessed since a given time is found in
+     * logarithmic time. Times run from 0 to window; when they run out,
+     * those in use are renumbered from 0 in the same order. */
+    uint32_t *tree;
+    uint64_t window, now;
+} shards_t;
+
+/* Public functions */
+
+/*
+ * Create a sampler for blocks of line_size bytes that estimates miss
+ * ratios for caches of up to max_bytes, in num_bins steps. Sampling
+ * starts at the given rate (at most 1) and is lowered as needed to track
+ * at most max_samples blocks. Returns NULL if a parameter is 0, the rate
+ * is out of range, or max_bytes holds fewer than num_bins lines.
+ */
+shards_t *shards_new(size_t line_size, uint64_t max_bytes, unsigned int num_bins,
+                     size_t max_samples, double rate);
+
+/*
+ * Frees all memory allocated for the sampler.
+ */
+void shards_free(shards_t *shards);
+
+/*
+ * Record an access to a block number (an address divided by the line
+ * size). The context is the sampler, so this can be attached to a cache
+ * with cache_set_observer.
+ */
+void shards_observe(void *shards, uint64_t block);
+
+/*
+ * Record an access to an address.
+ */
+void shards_access(shards_t *shards, uintptr_t address);
+
+/*
+ * Return the current sampling rate.
+ */
+double shards_rate(shards_t *shards);
+
+/*
+ * Return the estimated miss ratio of a fully associative LRU cache of
+ * the given size, interpolated between bins.
+ */
+double shards_miss_ratio(shards_t *shards, uint64_t cache_bytes);
+
+/*
+ * Print the miss ratio curve, one line per bin.
+ */
+void shards_report(shards_t *shards, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
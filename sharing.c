@@ -0,0 +1,264 @@
+#include "sharing.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Associativity of the table of tracked lines.
+ */
+#define SHARING_TABLE_WAYS 16
+
+/*
+ * The table is LRU, so it never needs a random number.
+ */
+static int sharing_no_random(void) {
+    return 0;
+}
+
+/*
+ * Create an analysis.
+ */
+sharing_t *sharing_new(size_t line_size, size_t max_lines, unsigned int num_threads) {
+    if (num_threads == 0 || num_threads > SHARING_MAX_THREADS || max_lines == 0) {
+        return NULL;
+    }
+
+    // Round the table up to whole sets.
+    max_lines = (max_lines + SHARING_TABLE_WAYS - 1) / SHARING_TABLE_WAYS * SHARING_TABLE_WAYS;
+    cache_t *table = cache_new(max_lines * line_size, line_size, SHARING_TABLE_WAYS,
+                               CACHE_REPLACEMENTPOLICY_LRU | CACHE_DATAPOLICY_NODATA);
+    if (table == NULL) {
+        return NULL;
+    }
+
+    sharing_t *sharing = (sharing_t *)calloc(1, sizeof(sharing_t));
+    sharing->table = table;
+    sharing->num_threads = num_threads;
+    sharing->granule = (line_size + 63) / 64;
+    sharing->lines = (sharing_line_t *)calloc(table->num_lines, sizeof(sharing_line_t));
+    sharing->masks = (uint64_t *)calloc((size_t)table->num_lines * num_threads * 2, sizeof(uint64_t));
+    for (size_t i = 0; i < table->num_lines; i++) {
+        sharing->lines[i].masks = sharing->masks + i * num_threads * 2;
+    }
+
+    // The retired table has the geometry of the table of tracked lines.
+    sharing->num_retired_sets = table->num_sets;
+    sharing->retired = (sharing_line_t *)calloc(table->num_lines, sizeof(sharing_line_t));
+    sharing->retired_masks = (uint64_t *)calloc((size_t)table->num_lines * num_threads * 2, sizeof(uint64_t));
+    for (size_t i = 0; i < table->num_lines; i++) {
+        sharing->retired[i].masks = sharing->retired_masks + i * num_threads * 2;
+    }
+
+    return sharing;
+}
+
+/*
+ * Frees all memory allocated for the analysis.
+ */
+void sharing_free(sharing_t *sharing) {
+    free(sharing->retired);
+    free(sharing->retired_masks);
+    free(sharing->masks);
+    free(sharing->lines);
+    cache_free(sharing->table);
+    free(sharing);
+}
+
+/*
+ * Return the first entry of the set of the retired table a block
+ * belongs to.
+ */
+static sharing_line_t *sharing_retired_set(sharing_t *sharing, uint64_t block) {
+    size_t set = ((block * 0x9E3779B97F4A7C15ULL) >> 32) % sharing->num_retired_sets;
+    return &sharing->retired[set * SHARING_TABLE_WAYS];
+}
+
+/*
+ * Copy a line, masks included, or clear it if from is NULL.
+ */
+static void sharing_line_copy(sharing_t *sharing, sharing_line_t *to, const sharing_line_t *from) {
+    size_t mask_bytes = sharing->num_threads * 2 * sizeof(uint64_t);
+    uint64_t *masks = to->masks;
+
+    if (from != NULL) {
+        *to = *from;
+        memcpy(masks, from->masks, mask_bytes);
+    } else {
+        memset(to, 0, sizeof(*to));
+        memset(masks, 0, mask_bytes);
+    }
+    to->masks = masks;
+}
+
+/*
+ * Retire a tracked line the table is about to reuse, keeping it if more
+ * than one thread accessed it, and set it up for the given block with
+ * whatever was retired of that block.
+ */
+static void sharing_line_retire(sharing_t *sharing, sharing_line_t *line, uint64_t block) {
+    if (line->accesses != 0 && (line->threads & (line->threads - 1)) != 0) {
+        // Take a free entry, or else the one with the fewest
+        // invalidations if this line has more.
+        sharing_line_t *set = sharing_retired_set(sharing, line->block);
+        sharing_line_t *victim = &set[0];
+        for (int w = 0; w < SHARING_TABLE_WAYS; w++) {
+            if (set[w].accesses == 0) {
+                victim = &set[w];
+                break;
+            }
+            if (set[w].invalidations < victim->invalidations) {
+                victim = &set[w];
+            }
+        }
+        if (victim->accesses == 0 || victim->invalidations < line->invalidations) {
+            if (victim->accesses != 0) {
+                sharing->dropped++;
+            }
+            sharing_line_copy(sharing, victim, line);
+        } else {
+            sharing->dropped++;
+        }
+    }
+
+    sharing_line_copy(sharing, line, NULL);
+    line->block = block;
+
+    sharing_line_t *set = sharing_retired_set(sharing, block);
+    for (int w = 0; w < SHARING_TABLE_WAYS; w++) {
+        if (set[w].accesses != 0 && set[w].block == block) {
+            sharing_line_copy(sharing, line, &set[w]);
+            sharing_line_copy(sharing, &set[w], NULL);
+            break;
+        }
+    }
+}
+
+/*
+ * Record an access by a thread.
+ */
+void sharing_access(sharing_t *sharing, unsigned int thread, uintptr_t address,
+                    size_t size, int is_write) {
+    if (thread >= sharing->num_threads) {
+        sharing->ignored++;
+        return;
+    }
+
+    cache_t *table = sharing->table;
+    uint64_t block = cache_block_number(table, address);
+
+    // Look the line up in the table, which also allocates it on a miss.
+    cache_read_block(table, address, block, sharing_no_random);
+    sharing_line_t *line = &sharing->lines[cache_probe(table, address, 0) - table->lines];
+    if (line->block != block || line->accesses == 0) {
+        sharing_line_retire(sharing, line, block);
+    }
+
+    // Mark the granules touched.
+    size_t offset = address - block * table->line_size;
+    if (size == 0) {
+        size = 1;
+    }
+    if (offset + size > table->line_size) {
+        size = table->line_size - offset;
+    }
+    size_t first = offset / sharing->granule, last = (offset + size - 1) / sharing->granule;
+    uint64_t mask = (last == 63 ? ~(uint64_t)0 : ((uint64_t)1 << (last + 1)) - 1)
+                    & ~(((uint64_t)1 << first) - 1);
+    uint64_t bit = (uint64_t)1 << thread;
+
+    line->accesses++;
+    line->threads |= bit;
+    if (is_write) {
+        line->writes++;
+        line->masks[2 * thread + 1] |= mask;
+        line->invalidations += __builtin_popcountll(line->sharers & ~bit);
+        line->sharers = bit;
+    } else {
+        line->masks[2 * thread] |= mask;
+        line->sharers |= bit;
+    }
+}
+
+/*
+ * Return whether a line is falsely shared.
+ */
+int sharing_line_is_false_shared(sharing_t *sharing, sharing_line_t *line) {
+    if (line->writes == 0 || (line->threads & (line->threads - 1)) == 0) {
+        return 0;
+    }
+
+    for (unsigned int t = 0; t < sharing->num_threads; t++) {
+        uint64_t written = line->masks[2 * t + 1];
+        if (written == 0) {
+            continue;
+        }
+        for (unsigned int u = 0; u < sharing->num_threads; u++) {
+            if (u != t && (written & (line->masks[2 * u] | line->masks[2 * u + 1])) != 0) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+ * Orderings for the report.
+ */
+static int sharing_by_invalidations(const void *a, const void *b) {
+    const sharing_line_t *x = *(sharing_line_t *const *)a, *y = *(sharing_line_t *const *)b;
+    return (x->invalidations < y->invalidations) - (x->invalidations > y->invalidations);
+}
+
+static int sharing_by_accesses(const void *a, const void *b) {
+    const sharing_line_t *x = *(sharing_line_t *const *)a, *y = *(sharing_line_t *const *)b;
+    return (x->accesses < y->accesses) - (x->accesses > y->accesses);
+}
+
+/*
+ * Print the falsely shared lines and the hottest lines.
+ */
+void sharing_report(sharing_t *sharing, FILE *out, unsigned int top) {
+    size_t total = 2 * (size_t)sharing->table->num_lines;
+    sharing_line_t **all = malloc(total * sizeof(sharing_line_t *));
+    sharing_line_t **shared = malloc(total * sizeof(sharing_line_t *));
+    size_t num_all = 0, num_shared = 0;
+    size_t line_size = sharing->table->line_size;
+
+    for (size_t i = 0; i < total; i++) {
+        sharing_line_t *line = i < sharing->table->num_lines
+                               ? &sharing->lines[i] : &sharing->retired[i - sharing->table->num_lines];
+        if (line->accesses == 0) {
+            continue;
+        }
+        all[num_all++] = line;
+        if (sharing_line_is_false_shared(sharing, line)) {
+            shared[num_shared++] = line;
+        }
+    }
+
+    qsort(shared, num_shared, sizeof(sharing_line_t *), sharing_by_invalidations);
+    if (sharing->ignored != 0) {
+        fprintf(out, "ignored: %" PRIu64 " accesses by threads out of range\n", sharing->ignored);
+    }
+    fprintf(out, "false sharing: %zu lines\n", num_shared);
+    if (sharing->dropped != 0) {
+        fprintf(out, "  (%" PRIu64 " retired lines dropped)\n", sharing->dropped);
+    }
+    for (size_t i = 0; i < num_shared && i < top; i++) {
+        sharing_line_t *line = shared[i];
+        fprintf(out, "  0x%016" PRIx64 "  %10" PRIu64 " invalidations  %10" PRIu64 " accesses  %2d threads\n",
+                line->block * line_size, line->invalidations, line->accesses,
+                __builtin_popcountll(line->threads));
+    }
+
+    qsort(all, num_all, sizeof(sharing_line_t *), sharing_by_accesses);
+    fprintf(out, "hot lines:\n");
+    for (size_t i = 0; i < num_all && i < top; i++) {
+        sharing_line_t *line = all[i];
+        fprintf(out, "  0x%016" PRIx64 "  %10" PRIu64 " accesses  %10" PRIu64 " writes  %2d threads\n",
+                line->block * line_size, line->accesses, line->writes,
+                __builtin_popcountll(line->threads));
+    }
+
+    free(all);
+    free(shared);
+}
@@ -0,0 +1,119 @@
+/*
+ * sharing.h
+ *
+ * Analysis of multi-threaded traces: finds lines that different threads
+ * keep taking from each other without touching the same bytes (false
+ * sharing), and the most accessed lines overall.
+ */
+#ifndef SHARING_H
+#define SHARING_H
+
+#include "cache.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Largest number of threads an analysis can track.
+ */
+#define SHARING_MAX_THREADS 64
+
+/*
+ * Structure used to store what is known about one line of memory.
+ */
+typedef struct sharing_line_s {
+    /* The block number of the line. */
+    uint64_t block;
+
+    /* Number of accesses and of writes. */
+    uint64_t accesses, writes;
+
+    /* Estimated number of invalidations: every write by one thread
+     * invalidates the copies of the other threads that accessed the
+     * line since the last write. */
+    uint64_t invalidations;
+
+    /* Threads holding a copy under that estimate, and threads that ever
+     * accessed the line, one bit per thread. */
+    uint64_t sharers, threads;
+
+    /* For every thread, the parts of the line it read, then the parts
+     * it wrote, one bit per granule. */
+    uint64_t *masks;
+} sharing_line_t;
+
+/*
+ * Structure used to store an analysis.
+ */
+typedef struct sharing_s {
+    /* Tag-only LRU cache whose lines select the tracked lines. */
+    cache_t *table;
+
+    /* The tracked lines, one per line of the table, and their masks. */
+    sharing_line_t *lines;
+    uint64_t *masks;
+
+    /* Number of threads, and bytes of a line per mask bit. */
+    unsigned int num_threads;
+    size_t granule;
+
+    /* Accesses ignored because their thread was out of range. */
+    uint64_t ignored;
+
+    /* Lines accessed by more than one thread that the table evicted,
+     * one entry per block in a set-associative table of as many entries
+     * as the table of tracked lines, and their masks. A line that comes
+     * back is taken out again, so a block is either tracked or retired.
+     * When a set is full the line with the fewest invalidations is
+     * dropped, and counted. */
+    sharing_line_t *retired;
+    uint64_t *retired_masks;
+    size_t num_retired_sets;
+    uint64_t dropped;
+} sharing_t;
+
+/* Public functions */
+
+/*
+ * Create an analysis of lines of line_size bytes, tracking up to
+ * max_lines of them at a time and up to num_threads threads (at most
+ * SHARING_MAX_THREADS). When more lines are accessed, the least recently
+ * used is retired: it is kept for the report only if several threads
+ * accessed it, in a table of max_lines more, and its counts resume if
+ * it is accessed again. Memory stays bounded whatever the trace. Masks
+ * are byte-level for lines of up to 64 bytes and coarser for longer
+ * lines. Returns NULL if the parameters are invalid.
+ */
+sharing_t *sharing_new(size_t line_size, size_t max_lines, unsigned int num_threads);
+
+/*
+ * Frees all memory allocated for the analysis.
+ */
+void sharing_free(sharing_t *sharing);
+
+/*
+ * Record an access of size bytes at the given address by the given
+ * thread. Accesses by threads at or above num_threads are ignored and
+ * counted.
+ */
+void sharing_access(sharing_t *sharing, unsigned int thread, uintptr_t address,
+                    size_t size, int is_write);
+
+/*
+ * Return whether a line is falsely shared: several threads accessed it,
+ * at least one wrote, and no thread wrote any byte another accessed.
+ */
+int sharing_line_is_false_shared(sharing_t *sharing, sharing_line_t *line);
+
+/*
+ * Print up to top falsely shared lines, ranked by estimated
+ * invalidations, then up to top lines ranked by accesses.
+ */
+void sharing_report(sharing_t *sharing, FILE *out, unsigned int top);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
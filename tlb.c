@@ -0,0 +1,162 @@
+#include "tlb.h"
+#include <assert.h>
+#include <stdlib.h>
+
+/*
+ * Page size in bytes and page table levels walked, per page size.
+ */
+static const size_t tlb_page_bytes[TLB_PAGE_SIZES] = { 1UL << 12, 1UL << 21, 1UL << 30 };
+static const unsigned int tlb_walk_levels[TLB_PAGE_SIZES] = { 4, 3, 2 };
+
+/*
+ * Create one TLB array, or NULL if it has no entries. Sets *ok to 0 if
+ * the geometry is impossible.
+ */
+static cache_t *tlb_array_new(unsigned int entries, unsigned int associativity,
+                              int page_size, int policy, int *ok) {
+    if (entries == 0) {
+        return NULL;
+    }
+    cache_t *array = cache_new((size_t)entries * tlb_page_bytes[page_size], tlb_page_bytes[page_size],
+                               associativity, (policy & CACHE_REPLACEMENTPOLICY_MASK) | CACHE_DATAPOLICY_NODATA);
+    if (array == NULL) {
+        *ok = 0;
+    }
+    return array;
+}
+
+/*
+ * Create a TLB with the given configuration.
+ */
+tlb_t *tlb_new(const tlb_config_t *config) {
+    tlb_t *tlb = (tlb_t *)calloc(1, sizeof(tlb_t));
+    int ok = 1;
+
+    for (int i = 0; i < TLB_PAGE_SIZES; i++) {
+        tlb->l1[i] = tlb_array_new(config->l1_entries[i], config->l1_associativity[i], i, config->policy, &ok);
+        tlb->l2[i] = tlb_array_new(config->l2_entries[i], config->l2_associativity[i], i, config->policy, &ok);
+    }
+    tlb->l2_latency = config->l2_latency;
+    tlb->walk_level_latency = config->walk_level_latency;
+
+    if (!ok) {
+        tlb_free(tlb);
+        return NULL;
+    }
+    return tlb;
+}
+
+/*
+ * Frees all memory allocated for the TLB.
+ */
+void tlb_free(tlb_t *tlb) {
+    for (int i = 0; i < TLB_PAGE_SIZES; i++) {
+        if (tlb->l1[i] != NULL) {
+            cache_free(tlb->l1[i]);
+        }
+        if (tlb->l2[i] != NULL) {
+            cache_free(tlb->l2[i]);
+        }
+    }
+    free(tlb->regions);
+    free(tlb);
+}
+
+/*
+ * Map a range of addresses with pages of the given size.
+ */
+void tlb_map(tlb_t *tlb, uintptr_t base, uintptr_t length, int page_size) {
+    tlb->regions = realloc(tlb->regions, (tlb->num_regions + 1) * sizeof(tlb_region_t));
+    tlb->regions[tlb->num_regions].base = base;
+    tlb->regions[tlb->num_regions].length = length;
+    tlb->regions[tlb->num_regions].page_size = page_size;
+    tlb->num_regions++;
+}
+
+/*
+ * Set the translation applied before accessing the cache.
+ */
+void tlb_set_translation(tlb_t *tlb, tlb_translate_t translate, void *context) {
+    tlb->translate = translate;
+    tlb->translate_context = context;
+}
+
+/*
+ * Return the size of the page an address lies in.
+ */
+static int tlb_page_size(tlb_t *tlb, uintptr_t address) {
+    for (unsigned int i = tlb->num_regions; i > 0; i--) {
+        tlb_region_t *region = &tlb->regions[i - 1];
+        if (address - region->base < region->length) {
+            return region->page_size;
+        }
+    }
+    return TLB_PAGE_4K;
+}
+
+/*
+ * Look the page of an address up in the TLB.
+ */
+int tlb_lookup(tlb_t *tlb, uintptr_t address, func_t generate_random_number) {
+    int page_size = tlb_page_size(tlb, address);
+    cache_t *l1 = tlb->l1[page_size], *l2 = tlb->l2[page_size];
+
+    tlb->accesses[page_size]++;
+
+    // Every array the lookup reaches is filled on the way back.
+    if (l1 != NULL && cache_lookup(l1, address, generate_random_number)) {
+        return 1;
+    }
+    tlb->l1_misses[page_size]++;
+
+    if (l2 != NULL) {
+        tlb->cycles += tlb->l2_latency;
+        if (cache_lookup(l2, address, generate_random_number)) {
+            return 2;
+        }
+    }
+
+    tlb->walks[page_size]++;
+    tlb->cycles += tlb_walk_levels[page_size] * tlb->walk_level_latency;
+    return 0;
+}
+
+/*
+ * Translate an address through the TLB, then read it from the cache.
+ */
+long tlb_read(tlb_t *tlb, cache_t *cache, uintptr_t address, func_t generate_random_number) {
+    tlb_lookup(tlb, address, generate_random_number);
+    if (tlb->translate != NULL) {
+        // A data cache would copy the block from the physical address.
+        assert((cache->policies & CACHE_DATAPOLICY_MASK) == CACHE_DATAPOLICY_NODATA);
+        address = tlb->translate(tlb->translate_context, address);
+    }
+    return cache_read(cache, address, generate_random_number);
+}
+
+/*
+ * Print the TLB statistics, followed by those of the cache.
+ */
+void tlb_report(tlb_t *tlb, cache_t *cache, FILE *out) {
+    static const char *names[TLB_PAGE_SIZES] = { "4K", "2M", "1G" };
+    uint64_t accesses = 0, l1_misses = 0, walks = 0;
+
+    for (int i = 0; i < TLB_PAGE_SIZES; i++) {
+        accesses += tlb->accesses[i];
+        l1_misses += tlb->l1_misses[i];
+        walks += tlb->walks[i];
+        if (tlb->accesses[i] == 0) {
+            continue;
+        }
+        fprintf(out, "TLB %s pages:     %" PRIu64 " accesses, L1 miss %.4f, L2 miss %.4f\n",
+                names[i], tlb->accesses[i], (double)tlb->l1_misses[i] / tlb->accesses[i],
+                tlb->l1_misses[i] ? (double)tlb->walks[i] / tlb->l1_misses[i] : 0.0);
+    }
+    fprintf(out, "TLB accesses:     %" PRIu64 "\n", accesses);
+    fprintf(out, "TLB L1 misses:    %" PRIu64 " (%.4f)\n", l1_misses,
+            accesses ? (double)l1_misses / accesses : 0.0);
+    fprintf(out, "page walks:       %" PRIu64 " (%.4f)\n", walks,
+            accesses ? (double)walks / accesses : 0.0);
+    fprintf(out, "TLB cycles:       %" PRIu64 "\n", tlb->cycles);
+    cache_report(cache, out);
+}
@@ -0,0 +1,136 @@
+/*
+ * tlb.h
+ *
+ * Two-level TLB model in front of a cache. Each TLB array is a tag-only
+ * cache_t whose line size is a page size, so TLB entries are looked up
+ * and replaced exactly like cache lines.
+ */
+#ifndef TLB_H
+#define TLB_H
+
+#include "cache.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Page sizes. Every page size has its own L1 and L2 arrays.
+ */
+#define TLB_PAGE_4K    0
+#define TLB_PAGE_2M    1
+#define TLB_PAGE_1G    2
+#define TLB_PAGE_SIZES 3
+
+/*
+ * Geometry and costs of a TLB. An array with 0 entries is left out: an
+ * L1 miss then goes straight to L2, and an L2 miss to a page walk.
+ */
+typedef struct tlb_config_s {
+    /* Entries and associativity of the L1 arrays, per page size. */
+    unsigned int l1_entries[TLB_PAGE_SIZES], l1_associativity[TLB_PAGE_SIZES];
+
+    /* Entries and associativity of the L2 arrays, per page size. */
+    unsigned int l2_entries[TLB_PAGE_SIZES], l2_associativity[TLB_PAGE_SIZES];
+
+    /* Cycles for an L1 miss that hits in L2. */
+    unsigned int l2_latency;
+
+    /* Cycles per page table level read by a walk. Walks read 4 levels
+     * for 4K pages, 3 for 2M pages and 2 for 1G pages. */
+    unsigned int walk_level_latency;
+
+    /* Replacement policy of all arrays. */
+    int policy;
+} tlb_config_t;
+
+/*
+ * A range of addresses mapped with pages of a given size.
+ */
+typedef struct tlb_region_s {
+    uintptr_t base, length;
+    int page_size;
+} tlb_region_t;
+
+/*
+ * Translation from a virtual to a physical address, with its context.
+ */
+typedef uintptr_t (*tlb_translate_t)(void *context, uintptr_t address);
+
+/*
+ * Structure used to store a TLB.
+ */
+typedef struct tlb_s {
+    /* The arrays of each level, per page size, or NULL. */
+    cache_t *l1[TLB_PAGE_SIZES], *l2[TLB_PAGE_SIZES];
+
+    /* Costs, copied from the configuration. */
+    unsigned int l2_latency, walk_level_latency;
+
+    /* Translation applied before the cache is accessed, or NULL for a
+     * virtually indexed cache. */
+    tlb_translate_t translate;
+    void *translate_context;
+
+    /* Regions mapped with large pages; everything else uses 4K pages. */
+    tlb_region_t *regions;
+    unsigned int num_regions;
+
+    /* Statistics per page size. */
+    uint64_t accesses[TLB_PAGE_SIZES], l1_misses[TLB_PAGE_SIZES], walks[TLB_PAGE_SIZES];
+
+    /* Cycles spent in L2 lookups and page walks. */
+    uint64_t cycles;
+} tlb_t;
+
+/* Public functions */
+
+/*
+ * Create a TLB with the given configuration. Returns NULL if one of the
+ * arrays has an impossible geometry.
+ */
+tlb_t *tlb_new(const tlb_config_t *config);
+
+/*
+ * Frees all memory allocated for the TLB.
+ */
+void tlb_free(tlb_t *tlb);
+
+/*
+ * Map a range of addresses with pages of the given size. Later mappings
+ * take precedence over earlier ones where they overlap.
+ */
+void tlb_map(tlb_t *tlb, uintptr_t base, uintptr_t length, int page_size);
+
+/*
+ * Set the translation tlb_read applies before accessing the cache, for
+ * instance page_table_translate with a page table as context. Pass NULL
+ * to access the cache with virtual addresses. Translated addresses are
+ * not mapped in this process, so the cache read through them must be
+ * tag-only (CACHE_DATAPOLICY_NODATA).
+ */
+void tlb_set_translation(tlb_t *tlb, tlb_translate_t translate, void *context);
+
+/*
+ * Look the page of an address up in the TLB, walking the page table on
+ * a miss. Returns 1 for an L1 hit, 2 for an L2 hit and 0 for a walk.
+ */
+int tlb_lookup(tlb_t *tlb, uintptr_t address, func_t generate_random_number);
+
+/*
+ * Translate an address through the TLB, then read it from the cache,
+ * using the physical address if a translation was set, in which case
+ * the cache must be tag-only.
+ */
+long tlb_read(tlb_t *tlb, cache_t *cache, uintptr_t address, func_t generate_random_number);
+
+/*
+ * Print the TLB statistics, followed by those of the cache behind it.
+ */
+void tlb_report(tlb_t *tlb, cache_t *cache, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
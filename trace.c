@@ -0,0 +1,389 @@
+#define _GNU_SOURCE
+#include "trace.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Leading bytes of zstd and lz4 frames.
+ */
+static const unsigned char trace_zstd_magic[4] = { 0x28, 0xb5, 0x2f, 0xfd };
+static const unsigned char trace_lz4_magic[4] = { 0x04, 0x22, 0x4d, 0x18 };
+
+/*
+ * Size of zlib's input buffer, and longest line of a text trace.
+ */
+#define TRACE_BUFFER (128 << 10)
+#define TRACE_LINE 512
+
+/*
+ * Start a decompressor on a file and return the read end of a pipe
+ * carrying its output, or -1 on failure, including when the tool is not
+ * installed.
+ */
+static int trace_spawn(trace_t *trace, const char *tool, const char *path) {
+    char *argv[] = { (char *)tool, "-dc", "--", (char *)path, NULL };
+    posix_spawn_file_actions_t actions;
+    int fds[2];
+
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        return -1;
+    }
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    int failed = posix_spawnp(&trace->child, tool, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+
+    if (failed) {
+        trace->child = 0;
+        close(fds[0]);
+        return -1;
+    }
+    return fds[0];
+}
+
+/*
+ * Wait for the decompressor, if any, stopping it first if terminate is
+ * set. Returns -1 if it failed.
+ */
+static int trace_reap(trace_t *trace, int terminate) {
+    int status;
+    if (trace->child <= 0) {
+        return 0;
+    }
+    if (terminate) {
+        kill(trace->child, SIGTERM);
+    }
+    if (waitpid(trace->child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Free the arrays of both batches.
+ */
+static void trace_free_batches(trace_t *trace) {
+    for (int b = 0; b < 2; b++) {
+        free(trace->batches[b].addresses);
+        free(trace->batches[b].pcs);
+        free(trace->batches[b].sizes);
+        free(trace->batches[b].types);
+    }
+}
+
+/*
+ * Append a record to a batch.
+ */
+static void trace_add(trace_batch_t *batch, int type, uint64_t address, uint64_t pc, uint32_t size) {
+    size_t i = batch->count++;
+    batch->addresses[i] = address;
+    batch->pcs[i] = pc;
+    batch->sizes[i] = size;
+    batch->types[i] = type;
+}
+
+/*
+ * Skip spaces and tabs.
+ */
+static char *trace_skip(char *s) {
+    while (*s == ' ' || *s == '\t') {
+        s++;
+    }
+    return s;
+}
+
+/*
+ * Parse one line of a text trace into the batch. Returns 0 if the line
+ * is not a record.
+ */
+static int trace_parse(trace_t *trace, trace_batch_t *batch, char *line) {
+    char *s = trace_skip(line), *end;
+    uint64_t address, pc = 0;
+    uint32_t size = 0;
+    int type;
+
+    switch (trace->format) {
+        case TRACE_FORMAT_DIN: {
+            // Labels 3 (escape) and 4 (cache flush) are not accesses.
+            long label = strtol(s, &end, 10);
+            if (end == s || label < 0 || label > 2) {
+                return 0;
+            }
+            s = end;
+            address = strtoull(s, &end, 16);
+            if (end == s) {
+                return 0;
+            }
+            type = label == 0 ? TRACE_READ : label == 1 ? TRACE_WRITE : TRACE_FETCH;
+            break;
+        }
+
+        case TRACE_FORMAT_LACKEY: {
+            char op = *s;
+            if (op != 'I' && op != 'L' && op != 'S' && op != 'M') {
+                return 0;
+            }
+            s = trace_skip(s + 1);
+            address = strtoull(s, &end, 16);
+            if (end == s) {
+                return 0;
+            }
+            if (*end == ',') {
+                size = strtoul(end + 1, NULL, 10);
+            }
+            if (op == 'M') {
+                trace_add(batch, TRACE_READ, address, 0, size);
+                type = TRACE_WRITE;
+            } else {
+                type = op == 'I' ? TRACE_FETCH : op == 'L' ? TRACE_READ : TRACE_WRITE;
+            }
+            break;
+        }
+
+        default: {
+            pc = strtoull(s, &end, 16);
+            if (end == s || *end != ':') {
+                return 0;
+            }
+            s = trace_skip(end + 1);
+            if (*s != 'R' && *s != 'W') {
+                return 0;
+            }
+            type = *s == 'R' ? TRACE_READ : TRACE_WRITE;
+            s = trace_skip(s + 1);
+            address = strtoull(s, &end, 16);
+            if (end == s) {
+                return 0;
+            }
+            size = strtoul(end, NULL, 10);
+            break;
+        }
+    }
+
+    trace_add(batch, type, address, pc, size);
+    return 1;
+}
+
+/*
+ * Decode records into a batch until it is full. Returns 0 at the end of
+ * the trace.
+ */
+static int trace_fill(trace_t *trace, trace_batch_t *batch) {
+    char line[TRACE_LINE];
+
+    if (trace->format == TRACE_FORMAT_BINARY) {
+        size_t wanted = (trace->batch_size - batch->count) * sizeof(uint64_t);
+        int n = gzread(trace->in, batch->addresses + batch->count, wanted);
+        if (n < 0) {
+            trace->error = 1;
+            return 0;
+        }
+        size_t records = n / sizeof(uint64_t);
+        memset(batch->pcs + batch->count, 0, records * sizeof(uint64_t));
+        memset(batch->sizes + batch->count, 0, records * sizeof(uint32_t));
+        memset(batch->types + batch->count, TRACE_READ, records);
+        batch->count += records;
+        return (size_t)n == wanted;
+    }
+
+    // A lackey modify yields two records, so stop one short.
+    while (batch->count + 1 < trace->batch_size) {
+        if (gzgets(trace->in, line, sizeof(line)) == NULL) {
+            int status;
+            gzerror(trace->in, &status);
+            if (status != Z_OK) {
+                trace->error = 1;
+            }
+            return 0;
+        }
+        if (!trace_parse(trace, batch, line)) {
+            trace->skipped++;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Decoder thread: fill the batches in turn, waiting for the reader to
+ * hand each one back before refilling it.
+ */
+static void *trace_decode(void *arg) {
+    trace_t *trace = arg;
+    int b = 0;
+
+    for (;;) {
+        trace_batch_t *batch = &trace->batches[b];
+
+        pthread_mutex_lock(&trace->lock);
+        while (batch->full && !trace->stop) {
+            pthread_cond_wait(&trace->changed, &trace->lock);
+        }
+        int stop = trace->stop;
+        pthread_mutex_unlock(&trace->lock);
+        if (stop) {
+            break;
+        }
+
+        batch->count = 0;
+        int more = trace_fill(trace, batch);
+
+        pthread_mutex_lock(&trace->lock);
+        trace->records += batch->count;
+        batch->full = batch->count > 0;
+        trace->done = !more;
+        pthread_cond_broadcast(&trace->changed);
+        pthread_mutex_unlock(&trace->lock);
+        if (!more) {
+            break;
+        }
+        b ^= 1;
+    }
+    return NULL;
+}
+
+/*
+ * Open a trace and start decoding it.
+ */
+trace_t *trace_open(const char *path, int format, size_t batch_size) {
+    if (format < TRACE_FORMAT_BINARY || format > TRACE_FORMAT_PIN) {
+        return NULL;
+    }
+    if (batch_size < 2) {
+        batch_size = TRACE_BATCH;
+    }
+
+    trace_t *trace = (trace_t *)calloc(1, sizeof(trace_t));
+    trace->format = format;
+    trace->batch_size = batch_size;
+    trace->current = -1;
+
+    int fd;
+    if (strcmp(path, "-") == 0) {
+        fd = dup(STDIN_FILENO);
+    } else {
+        fd = open(path, O_RDONLY);
+        unsigned char magic[4];
+        if (fd >= 0 && read(fd, magic, sizeof(magic)) == sizeof(magic)) {
+            const char *tool = memcmp(magic, trace_zstd_magic, 4) == 0 ? "zstd"
+                               : memcmp(magic, trace_lz4_magic, 4) == 0 ? "lz4" : NULL;
+            if (tool != NULL) {
+                close(fd);
+                fd = trace_spawn(trace, tool, path);
+            } else {
+                lseek(fd, 0, SEEK_SET);
+            }
+        } else if (fd >= 0) {
+            lseek(fd, 0, SEEK_SET);
+        }
+    }
+    if (fd < 0 || (trace->in = gzdopen(fd, "rb")) == NULL) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        trace_reap(trace, 1);
+        free(trace);
+        return NULL;
+    }
+    gzbuffer(trace->in, TRACE_BUFFER);
+
+    for (int b = 0; b < 2; b++) {
+        trace->batches[b].addresses = (uint64_t *)malloc(batch_size * sizeof(uint64_t));
+        trace->batches[b].pcs = (uint64_t *)malloc(batch_size * sizeof(uint64_t));
+        trace->batches[b].sizes = (uint32_t *)malloc(batch_size * sizeof(uint32_t));
+        trace->batches[b].types = (uint8_t *)malloc(batch_size);
+    }
+
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_cond_init(&trace->changed, NULL);
+    if (pthread_create(&trace->thread, NULL, trace_decode, trace) != 0) {
+        gzclose(trace->in);
+        trace_reap(trace, 1);
+        trace_free_batches(trace);
+        pthread_mutex_destroy(&trace->lock);
+        pthread_cond_destroy(&trace->changed);
+        free(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+/*
+ * Return the next batch of records.
+ */
+const trace_batch_t *trace_next_batch(trace_t *trace) {
+    trace_batch_t *batch = &trace->batches[trace->next];
+
+    pthread_mutex_lock(&trace->lock);
+    if (trace->current >= 0) {
+        trace->batches[trace->current].full = 0;
+        trace->current = -1;
+        pthread_cond_broadcast(&trace->changed);
+    }
+    while (!batch->full && !trace->done) {
+        pthread_cond_wait(&trace->changed, &trace->lock);
+    }
+    if (batch->full) {
+        trace->current = trace->next;
+        trace->next ^= 1;
+    } else {
+        batch = NULL;
+    }
+    pthread_mutex_unlock(&trace->lock);
+
+    return batch;
+}
+
+/*
+ * Stop decoding and free the trace.
+ */
+int trace_close(trace_t *trace) {
+    pthread_mutex_lock(&trace->lock);
+    int early = !trace->done;
+    trace->stop = 1;
+    pthread_cond_broadcast(&trace->changed);
+    pthread_mutex_unlock(&trace->lock);
+
+    // The decoder may be blocked reading from the decompressor.
+    if (early && trace->child > 0) {
+        kill(trace->child, SIGTERM);
+    }
+    pthread_join(trace->thread, NULL);
+    gzclose(trace->in);
+
+    int failed = trace_reap(trace, 0) < 0;
+    int error = early || trace->error || failed;
+    trace_free_batches(trace);
+    pthread_mutex_destroy(&trace->lock);
+    pthread_cond_destroy(&trace->changed);
+    free(trace);
+
+    return error ? -1 : 0;
+}
+
+/*
+ * Replay the rest of the trace through a cache.
+ */
+uint64_t trace_replay(trace_t *trace, cache_t *cache, func_t generate_random_number) {
+    const trace_batch_t *batch;
+    uint64_t count = 0;
+
+    while ((batch = trace_next_batch(trace)) != NULL) {
+        if (cache->bypass_counters != NULL) {
+            // The bypass predictor keys on the PC where the trace has one.
+            for (size_t i = 0; i < batch->count; i++) {
+                cache_access_t access = { .address = batch->addresses[i], .pc = batch->pcs[i] };
+                cache_read_access(cache, &access, generate_random_number != NULL ? generate_random_number : rand);
+            }
+        } else {
+            cache_replay(cache, batch->addresses, batch->count, NULL, NULL, NULL, generate_random_number);
+        }
+        count += batch->count;
+    }
+    return count;
+}
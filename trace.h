@@ -0,0 +1,134 @@
+/*
+ * trace.h
+ *
+ * Streaming readers for memory traces. Traces are decoded on a separate
+ * thread into two batches of records, one filled while the other is
+ * being simulated, so the simulator does not wait on I/O or parsing.
+ *
+ * Compressed traces are decompressed on the fly: gzip through zlib, and
+ * zstd and lz4 through the zstd and lz4 tools, whose output is read from
+ * a pipe. Nothing is decompressed to disk.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <zlib.h>
+#include "cache.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Trace formats. Binary is a sequence of 64-bit addresses in native byte
+ * order. Din is Dinero's "<label> <hex address>" per line, label 0
+ * being a read, 1 a write and 2 an instruction fetch. Lackey is the
+ * output of Valgrind's lackey tool with --trace-mem=yes, where a modify
+ * (M) yields a read and a write. Pin is the output of Pin's pinatrace,
+ * "<pc>: <R|W> <address> [<size>]" per line.
+ */
+#define TRACE_FORMAT_BINARY 0
+#define TRACE_FORMAT_DIN    1
+#define TRACE_FORMAT_LACKEY 2
+#define TRACE_FORMAT_PIN    3
+
+/*
+ * Types of record.
+ */
+#define TRACE_READ  0
+#define TRACE_WRITE 1
+#define TRACE_FETCH 2
+
+/*
+ * Default number of records in a batch.
+ */
+#define TRACE_BATCH 65536
+
+/*
+ * A batch of decoded records, stored as one array per field so the
+ * addresses can be passed straight to cache_replay. pcs and sizes are 0
+ * where the format does not record them.
+ */
+typedef struct trace_batch_s {
+    uint64_t *addresses;
+    uint64_t *pcs;
+    uint32_t *sizes;
+    uint8_t *types;
+    size_t count;
+
+    /* Set by the decoder when the batch is ready, cleared by the reader
+     * when it is done with it. */
+    int full;
+} trace_batch_t;
+
+/*
+ * Structure used to store an open trace.
+ */
+typedef struct trace_s {
+    int format;
+    size_t batch_size;
+
+    /* The decompressed stream, and the decompressor feeding it through
+     * a pipe, or 0 if there is none. */
+    gzFile in;
+    pid_t child;
+
+    /* The two batches, the one the reader holds (-1 if none) and the one
+     * it takes next. */
+    trace_batch_t batches[2];
+    int current, next;
+
+    /* Decoder thread, and the lock and condition guarding the batches
+     * and flags. done is set at the end of the trace, stop when the
+     * trace is closed before its end, and error if it could not be
+     * decoded completely. */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int done, stop, error;
+
+    /* Number of records decoded, and of lines that were not records. */
+    uint64_t records, skipped;
+} trace_t;
+
+/* Public functions */
+
+/*
+ * Open a trace in the given format, "-" being standard input, and start
+ * decoding it into batches of batch_size records (0 for TRACE_BATCH).
+ * Compression is detected from the contents; standard input may be
+ * gzip compressed or not. Returns NULL if the trace cannot be opened or
+ * the format is unknown.
+ */
+trace_t *trace_open(const char *path, int format, size_t batch_size);
+
+/*
+ * Return the next batch of records, or NULL at the end of the trace. The
+ * batch stays valid until the next call, while the decoder fills the
+ * other one.
+ */
+const trace_batch_t *trace_next_batch(trace_t *trace);
+
+/*
+ * Stop decoding and free the trace. Returns 0 if the whole trace was
+ * decoded, or -1 if it was closed early or could not be read or
+ * decompressed completely.
+ */
+int trace_close(trace_t *trace);
+
+/*
+ * Replay the rest of the trace through a cache with cache_replay, and
+ * return the number of records replayed. Writes and fetches are replayed
+ * as reads, and a cache that predicts bypasses gets the PC of every
+ * record that has one. The cache should be tag-only, as the traced
+ * addresses are not mapped in this process.
+ */
+uint64_t trace_replay(trace_t *trace, cache_t *cache, func_t generate_random_number);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,321 @@
+#include "workload.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Return the next 64 random bits of the stream (splitmix64).
+ */
+static uint64_t workload_random(workload_t *workload) {
+    uint64_t z = (workload->state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/*
+ * Return a random number in [0, 1).
+ */
+static double workload_uniform(workload_t *workload) {
+    return (workload_random(workload) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Return a random number in [0, n).
+ */
+static uint64_t workload_below(workload_t *workload, uint64_t n) {
+    return (uint64_t)(((unsigned __int128)workload_random(workload) * n) >> 64);
+}
+
+/*
+ * Map x in [0, elements) to a distinct element in [0, elements). Each
+ * round is a bijection over [0, 2^permute_bits), and results outside the
+ * range are sent through it again until they land inside, which keeps
+ * it a bijection over the range.
+ */
+static uint64_t workload_permute(workload_t *workload, uint64_t x) {
+    unsigned int bits = workload->permute_bits;
+    uint64_t mask = bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+    unsigned int shift = bits / 2 + 1;
+
+    do {
+        for (int round = 0; round < 2; round++) {
+            x = (x * workload->permute_keys[round]) & mask;
+            x ^= x >> shift;
+        }
+    } while (x >= workload->elements);
+    return x;
+}
+
+/*
+ * Helpers of the rejection-inversion Zipf sampler (Hörmann and
+ * Derflinger): log1p(x) / x and expm1(x) / x, accurate near 0.
+ */
+static double workload_zipf_helper1(double x) {
+    return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+static double workload_zipf_helper2(double x) {
+    return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x * 0.5 * (1 + x * (1.0 / 3) * (1 + 0.25 * x));
+}
+
+/*
+ * The hat function h(x) = x^-exponent, its integral H and the inverse of
+ * H.
+ */
+static double workload_zipf_h(double exponent, double x) {
+    return exp(-exponent * log(x));
+}
+
+static double workload_zipf_integral(double exponent, double x) {
+    double log_x = log(x);
+    return workload_zipf_helper2((1 - exponent) * log_x) * log_x;
+}
+
+static double workload_zipf_inverse(double exponent, double x) {
+    double t = x * (1 - exponent);
+    if (t < -1) {
+        t = -1;
+    }
+    return exp(workload_zipf_helper1(t) * x);
+}
+
+/*
+ * Return a Zipf distributed rank in [1, elements].
+ */
+static uint64_t workload_zipf(workload_t *workload) {
+    double exponent = workload->config.zipf_exponent;
+    uint64_t n = workload->elements;
+
+    for (;;) {
+        double u = workload->zipf_h_n + workload_uniform(workload) * (workload->zipf_h_x1 - workload->zipf_h_n);
+        double x = workload_zipf_inverse(exponent, u);
+        uint64_t k = x + 0.5 < 1 ? 1 : x + 0.5 > n ? n : (uint64_t)(x + 0.5);
+        if (k - x <= workload->zipf_s
+            || u >= workload_zipf_integral(exponent, k + 0.5) - workload_zipf_h(exponent, k)) {
+            return k;
+        }
+    }
+}
+
+/*
+ * Create a stream from a configuration.
+ */
+workload_t *workload_new(const workload_config_t *config) {
+    const workload_config_t *c = config;
+    uint64_t elements = c->element_size > 0 ? c->footprint / c->element_size : 0;
+
+    if (c->kind == WORKLOAD_MATRIX) {
+        if (c->element_size == 0 || c->matrix_size == 0 || c->tile_size == 0) {
+            return NULL;
+        }
+    } else if (c->kind < WORKLOAD_SEQUENTIAL || c->kind > WORKLOAD_POINTER_CHASE || elements == 0
+               || (c->kind == WORKLOAD_STRIDED && c->stride == 0)
+               || (c->kind == WORKLOAD_ZIPF && !(c->zipf_exponent >= 0))
+               || (c->kind == WORKLOAD_HOTSPOT
+                   && !(elements >= 2 && c->hot_fraction > 0 && c->hot_fraction < 1
+                        && c->hot_probability >= 0 && c->hot_probability <= 1))) {
+        return NULL;
+    }
+
+    workload_t *workload = (workload_t *)calloc(1, sizeof(workload_t));
+    workload->config = *config;
+    workload->elements = elements;
+
+    while (workload->permute_bits < 64 && (1ULL << workload->permute_bits) < elements) {
+        workload->permute_bits++;
+    }
+
+    if (c->kind == WORKLOAD_ZIPF) {
+        double exponent = c->zipf_exponent;
+        workload->zipf_h_x1 = workload_zipf_integral(exponent, 1.5) - 1;
+        workload->zipf_h_n = workload_zipf_integral(exponent, elements + 0.5);
+        workload->zipf_s = 2 - workload_zipf_inverse(exponent, workload_zipf_integral(exponent, 2.5)
+                                                               - workload_zipf_h(exponent, 2));
+    } else if (c->kind == WORKLOAD_HOTSPOT) {
+        workload->hot_elements = (uint64_t)(elements * c->hot_fraction);
+        if (workload->hot_elements == 0) {
+            workload->hot_elements = 1;
+        }
+        if (workload->hot_elements == elements) {
+            workload->hot_elements = elements - 1;
+        }
+    }
+
+    workload_reset(workload);
+    return workload;
+}
+
+/*
+ * Create a stream running the given streams in turn.
+ */
+workload_t *workload_new_phases(workload_t **phases, const uint64_t *lengths, size_t num_phases) {
+    if (num_phases == 0) {
+        return NULL;
+    }
+    for (size_t i = 0; i < num_phases; i++) {
+        if (phases[i] == NULL || lengths[i] == 0) {
+            return NULL;
+        }
+    }
+
+    workload_t *workload = (workload_t *)calloc(1, sizeof(workload_t));
+    workload->config.kind = WORKLOAD_PHASES;
+    workload->phases = (workload_t **)malloc(num_phases * sizeof(workload_t *));
+    workload->phase_lengths = (uint64_t *)malloc(num_phases * sizeof(uint64_t));
+    memcpy(workload->phases, phases, num_phases * sizeof(workload_t *));
+    memcpy(workload->phase_lengths, lengths, num_phases * sizeof(uint64_t));
+    workload->num_phases = num_phases;
+    return workload;
+}
+
+/*
+ * Frees all memory allocated for the stream and its phases.
+ */
+void workload_free(workload_t *workload) {
+    for (size_t i = 0; i < workload->num_phases; i++) {
+        workload_free(workload->phases[i]);
+    }
+    free(workload->phases);
+    free(workload->phase_lengths);
+    free(workload);
+}
+
+/*
+ * Restart the stream from its seed.
+ */
+void workload_reset(workload_t *workload) {
+    workload->state = workload->config.seed;
+    workload->position = 0;
+
+    // The permutation keys are drawn first, so they depend on the seed
+    // alone; multipliers must be odd to be invertible.
+    workload->permute_keys[0] = workload_random(workload) | 1;
+    workload->permute_keys[1] = workload_random(workload) | 1;
+
+    workload->ii = workload->jj = workload->kk = 0;
+    workload->i = workload->j = workload->k = 0;
+    workload->operand = 0;
+
+    workload->phase = 0;
+    workload->phase_count = 0;
+    for (size_t i = 0; i < workload->num_phases; i++) {
+        workload_reset(workload->phases[i]);
+    }
+}
+
+/*
+ * Return the next address of a matrix stream, and advance through the
+ * loop nest ii, jj, kk, i, j, k.
+ */
+static uint64_t workload_matrix_next(workload_t *workload) {
+    const workload_config_t *c = &workload->config;
+    size_t n = c->matrix_size, tile = c->tile_size;
+    uint64_t matrix_bytes = (uint64_t)n * n * c->element_size;
+    uint64_t address;
+
+    if (workload->operand == 0) {
+        workload->operand = 1;
+        return c->base + ((uint64_t)workload->i * n + workload->k) * c->element_size;
+    }
+    if (workload->operand == 1) {
+        address = c->base + matrix_bytes + ((uint64_t)workload->k * n + workload->j) * c->element_size;
+        size_t k_end = workload->kk + tile < n ? workload->kk + tile : n;
+        workload->operand = ++workload->k == k_end ? 2 : 0;
+        return address;
+    }
+
+    address = c->base + 2 * matrix_bytes + ((uint64_t)workload->i * n + workload->j) * c->element_size;
+    workload->operand = 0;
+
+    size_t j_end = workload->jj + tile < n ? workload->jj + tile : n;
+    size_t i_end = workload->ii + tile < n ? workload->ii + tile : n;
+    if (++workload->j == j_end) {
+        workload->j = workload->jj;
+        if (++workload->i == i_end) {
+            workload->kk += tile;
+            if (workload->kk >= n) {
+                workload->kk = 0;
+                workload->jj += tile;
+                if (workload->jj >= n) {
+                    workload->jj = 0;
+                    workload->ii += tile;
+                    if (workload->ii >= n) {
+                        workload->ii = 0;
+                    }
+                }
+            }
+            workload->i = workload->ii;
+            workload->j = workload->jj;
+        }
+    }
+    workload->k = workload->kk;
+    return address;
+}
+
+/*
+ * Return the next address of the stream.
+ */
+uint64_t workload_next(workload_t *workload) {
+    const workload_config_t *c = &workload->config;
+    uint64_t element;
+
+    switch (c->kind) {
+        case WORKLOAD_SEQUENTIAL:
+            element = workload->position;
+            if (++workload->position == workload->elements) {
+                workload->position = 0;
+            }
+            return c->base + element * c->element_size;
+
+        case WORKLOAD_STRIDED: {
+            uint64_t offset = workload->position;
+            workload->position = (workload->position + c->stride) % (workload->elements * c->element_size);
+            return c->base + offset / c->element_size * c->element_size;
+        }
+
+        case WORKLOAD_UNIFORM:
+            return c->base + workload_below(workload, workload->elements) * c->element_size;
+
+        case WORKLOAD_ZIPF:
+            element = workload_permute(workload, workload_zipf(workload) - 1);
+            return c->base + element * c->element_size;
+
+        case WORKLOAD_HOTSPOT:
+            if (workload_uniform(workload) < c->hot_probability) {
+                element = workload_below(workload, workload->hot_elements);
+            } else {
+                element = workload->hot_elements
+                          + workload_below(workload, workload->elements - workload->hot_elements);
+            }
+            return c->base + element * c->element_size;
+
+        case WORKLOAD_POINTER_CHASE:
+            element = workload_permute(workload, workload->position);
+            if (++workload->position == workload->elements) {
+                workload->position = 0;
+            }
+            return c->base + element * c->element_size;
+
+        case WORKLOAD_MATRIX:
+            return workload_matrix_next(workload);
+
+        default: {
+            uint64_t address = workload_next(workload->phases[workload->phase]);
+            if (++workload->phase_count == workload->phase_lengths[workload->phase]) {
+                workload->phase_count = 0;
+                workload->phase = (workload->phase + 1) % workload->num_phases;
+            }
+            return address;
+        }
+    }
+}
+
+/*
+ * Write the next count addresses of the stream to addresses.
+ */
+void workload_fill(workload_t *workload, uint64_t *addresses, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        addresses[i] = workload_next(workload);
+    }
+}
@@ -0,0 +1,145 @@
+/*
+ * workload.h
+ *
+ * Synthetic address streams for benchmarks and policy comparisons.
+ * Every stream is generated on the fly from a seed in constant memory,
+ * so the same configuration always yields the same addresses and long
+ * runs need no trace file.
+ */
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Kinds of stream. Addresses are base plus a multiple of element_size
+ * within footprint bytes, except for the matrix kind.
+ *
+ * Sequential scans the footprint in order and strided jumps by stride
+ * bytes, both wrapping around at its end. Uniform picks elements at
+ * random. Zipf picks the element of rank k with probability
+ * proportional to 1 / k^exponent, with ranks scattered over the
+ * footprint. Hotspot picks from the first hot_fraction of the footprint
+ * with probability hot_probability and from the rest otherwise.
+ * Pointer-chase follows a linked list threading every element in a
+ * random order. Matrix walks C = A * B for matrix_size x matrix_size
+ * matrices in tile_size tiles, reading A and B in the inner loop and C
+ * once per tile row, with the three matrices laid out from base.
+ */
+#define WORKLOAD_SEQUENTIAL    0
+#define WORKLOAD_STRIDED       1
+#define WORKLOAD_UNIFORM       2
+#define WORKLOAD_ZIPF          3
+#define WORKLOAD_HOTSPOT       4
+#define WORKLOAD_POINTER_CHASE 5
+#define WORKLOAD_MATRIX        6
+#define WORKLOAD_PHASES        7
+
+/*
+ * Parameters of a stream. Fields that a kind does not use are ignored.
+ */
+typedef struct workload_config_s {
+    int kind;
+    uint64_t seed;
+
+    /* Range of the stream and the size of its elements. */
+    uint64_t base, footprint;
+    size_t element_size;
+
+    /* Strided: distance between consecutive addresses in bytes. */
+    size_t stride;
+
+    /* Zipf: skew, 0 being uniform. */
+    double zipf_exponent;
+
+    /* Hotspot: share of the footprint that is hot, and share of the
+     * accesses that go to it. */
+    double hot_fraction, hot_probability;
+
+    /* Matrix: matrix dimension and tile dimension, in elements. */
+    size_t matrix_size, tile_size;
+} workload_config_t;
+
+/*
+ * Structure used to store the state of a stream.
+ */
+typedef struct workload_s {
+    workload_config_t config;
+
+    /* Generator state, and the number of elements in the footprint. */
+    uint64_t state, elements;
+
+    /* Position in sequential, strided and pointer-chase streams. */
+    uint64_t position;
+
+    /* Bijection over [0, 2^permute_bits) used to scatter Zipf ranks and
+     * to order the pointer-chase list. */
+    unsigned int permute_bits;
+    uint64_t permute_keys[2];
+
+    /* Zipf: constants of the rejection-inversion sampler. */
+    double zipf_h_x1, zipf_h_n, zipf_s;
+
+    /* Hotspot: number of hot elements. */
+    uint64_t hot_elements;
+
+    /* Matrix: tile origin, position within the tile, and which operand
+     * comes next. */
+    size_t ii, jj, kk, i, j, k;
+    int operand;
+
+    /* Phases: the streams run one after the other for the given number
+     * of addresses each, starting over after the last. */
+    struct workload_s **phases;
+    uint64_t *phase_lengths;
+    size_t num_phases, phase;
+    uint64_t phase_count;
+} workload_t;
+
+/* Public functions */
+
+/*
+ * Create a stream from a configuration. Returns NULL if the
+ * configuration is invalid.
+ */
+workload_t *workload_new(const workload_config_t *config);
+
+/*
+ * Create a stream running the given streams in turn, lengths[i]
+ * addresses from phases[i], repeating from the first after the last.
+ * The new stream takes ownership of the phases. Returns NULL if there
+ * are none or a length is 0.
+ */
+workload_t *workload_new_phases(workload_t **phases, const uint64_t *lengths, size_t num_phases);
+
+/*
+ * Frees all memory allocated for the stream and its phases.
+ */
+void workload_free(workload_t *workload);
+
+/*
+ * Restart the stream from its seed, so it yields the same addresses
+ * again.
+ */
+void workload_reset(workload_t *workload);
+
+/*
+ * Return the next address of the stream.
+ */
+uint64_t workload_next(workload_t *workload);
+
+/*
+ * Write the next count addresses of the stream to addresses.
+ */
+void workload_fill(workload_t *workload, uint64_t *addresses, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif